@@ -1,15 +1,18 @@
 #include "espif.h"
 #include "packet.h"
 #include "exception.h"
+#include "fault_injector.h"
 
 #include <dbus-tiny.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <string.h>
 #include <netdb.h>
 #include <string>
+#include <vector>
 #include <iostream>
 #include <boost/format.hpp>
 #include <boost/thread.hpp>
@@ -23,13 +26,15 @@ static const char *flash_info_expect = "OK flash function available, slots: 2, c
 enum
 {
 	sha1_hash_size = 20,
+	window_chunk_windows = 8,
 };
 
 Espif::Espif(const EspifConfig &config_in)
 	:
 		config(config_in),
 		channel(config),
-		util(channel, config)
+		util(channel, config),
+		name_cache(nullptr)
 {
 	struct timeval tv;
 	gettimeofday(&tv, nullptr);
@@ -38,6 +43,7 @@ Espif::Espif(const EspifConfig &config_in)
 
 Espif::~Espif()
 {
+	delete name_cache;
 }
 
 void Espif::read(const std::string &filename, int sector, int sectors) const
@@ -54,6 +60,7 @@ void Espif::read(const std::string &filename, int sector, int sectors) const
 	std::string sha_local_hash_text;
 	std::string sha_remote_hash_text;
 	std::string data;
+	unsigned int chunk_sectors, chunk;
 
 	if(filename.empty())
 		throw(hard_exception("file name required"));
@@ -72,12 +79,15 @@ void Espif::read(const std::string &filename, int sector, int sectors) const
 		EVP_DigestInit_ex(hash_ctx, EVP_sha1(), (ENGINE *)0);
 
 		retries = 0;
+		chunk_sectors = transfer_chunk();
 
-		for(current = sector, offset = 0; current < (sector + sectors); current++)
+		for(current = sector, offset = 0; current < (sector + sectors); current += chunk)
 		{
-			retries += util.read_sector(config.sector_size, current, data);
+			chunk = std::min(chunk_sectors, (unsigned int)(sector + sectors - current));
 
-			if(::write(file_fd, data.data(), data.length()) <= 0)
+			retries += util.read_sectors(current, chunk, data);
+
+			if(::pwrite(file_fd, data.data(), data.length(), offset) <= 0)
 				throw(hard_exception("i/o error in write"));
 
 			EVP_DigestUpdate(hash_ctx, (const unsigned char *)data.data(), data.length());
@@ -95,7 +105,7 @@ void Espif::read(const std::string &filename, int sector, int sectors) const
 			rate = offset / 1024.0 / duration;
 
 			std::cout << boost::format("received %3d kbytes in %2.0f seconds at rate %3.0f kbytes/s, received %3u sectors, retries %2u, %3u%%    \r") %
-					(offset / 1024) % duration % rate % (current - sector) % retries % ((offset * 100) / (sectors * config.sector_size));
+					(offset / 1024) % duration % rate % (current - sector + chunk) % retries % ((offset * 100) / (sectors * config.sector_size));
 			std::cout.flush();
 		}
 	}
@@ -109,6 +119,9 @@ void Espif::read(const std::string &filename, int sector, int sectors) const
 
 	close(file_fd);
 
+	if(config.verbose)
+		std::cout << std::endl << boost::format("rtt: %s, %s") % channel.rtt_text() % channel.pacing_text() << std::endl;
+
 	std::cout << boost::format("checksumming %u sectors from %u...") % sectors % sector << std::endl;
 
 	hash_size = sha1_hash_size;
@@ -144,9 +157,15 @@ void Espif::write(const std::string filename, int sector, bool simulate, bool ot
 	unsigned char hash[sha1_hash_size];
 	std::string sha_local_hash_text;
 	std::string sha_remote_hash_text;
-	std::string data;
-	unsigned int sectors_written, sectors_skipped, sectors_erased;
-	unsigned char sector_buffer[config.sector_size];
+	std::string data, next_data;
+	std::vector<std::string> compressed, next_compressed;
+	std::vector<std::string> remote_checksums;
+	std::vector<std::pair<int, unsigned int>> chunks;
+	boost::thread compressor;
+	unsigned int sectors_written, sectors_skipped, sectors_erased, sectors_sent, sectors_changed;
+	unsigned int chunk_sectors, chunk, index, transfer, packet;
+	uint64_t oob_sent;
+	bool compress;
 	struct stat stat;
 
 	if(filename.empty())
@@ -161,6 +180,8 @@ void Espif::write(const std::string filename, int sector, bool simulate, bool ot
 	sectors_skipped = 0;
 	sectors_erased = 0;
 	sectors_written = 0;
+	sectors_sent = 0;
+	sectors_changed = 0;
 	offset = 0;
 
 	try
@@ -179,6 +200,9 @@ void Espif::write(const std::string filename, int sector, bool simulate, bool ot
 			command += "write";
 		}
 
+		if(config.delta_write)
+			command += " (delta)";
+
 		std::cout << boost::format("start %s at address 0x%06x (sector %u), length: %u (%u sectors)") %
 				command % (sector * config.sector_size) % sector % (length * config.sector_size) % length << std::endl;
 
@@ -186,20 +210,101 @@ void Espif::write(const std::string filename, int sector, bool simulate, bool ot
 		EVP_DigestInit_ex(hash_ctx, EVP_sha1(), (ENGINE *)0);
 
 		retries = 0;
+		oob_sent = 0;
+		chunk_sectors = transfer_chunk();
+		transfer = util.transfer_sectors();
+		compress = util.oob_compression();
 
-		for(current = sector; current < (sector + length); current++)
+		// delta: only the sectors that differ from what's in flash go into the chunks,
+		// the whole image is hashed here then, so the final checksum still covers all of it
+
+		if(config.delta_write)
 		{
-			memset(sector_buffer, 0xff, config.sector_size);
+			util.get_checksums(sector, length, remote_checksums);
+
+			for(current = sector; current < (sector + length); current++)
+			{
+				data.assign(config.sector_size, 0xff);
+
+				if((::read(file_fd, data.data(), data.length())) <= 0)
+					throw(hard_exception("i/o error in read"));
+
+				EVP_DigestUpdate(hash_ctx, data.data(), data.length());
+
+				hash_size = sha1_hash_size;
+				EVP_Digest(data.data(), data.length(), hash, &hash_size, EVP_sha1(), (ENGINE *)0);
+
+				if(Util::sha1_hash_to_text(sha1_hash_size, hash) == remote_checksums[current - sector])
+					continue;
+
+				if(!chunks.empty() && ((chunks.back().first + (int)chunks.back().second) == current) && (chunks.back().second < chunk_sectors))
+					chunks.back().second++;
+				else
+					chunks.push_back({ current, 1 });
+
+				sectors_changed++;
+			}
 
-			if((::read(file_fd, sector_buffer, config.sector_size)) <= 0)
+			std::cout << boost::format("delta: %u sectors differ, %u sectors unchanged") % sectors_changed % (length - sectors_changed) << std::endl;
+		}
+		else
+		{
+			for(current = sector; current < (sector + length); current += chunk_sectors)
+				chunks.push_back({ current, std::min(chunk_sectors, (unsigned int)(sector + length - current)) });
+
+			sectors_changed = length;
+		}
+
+		auto read_chunk = [&](const std::pair<int, unsigned int> &range, std::string &chunk_data)
+		{
+			chunk_data.assign(range.second * config.sector_size, 0xff);
+
+			if(pread(file_fd, chunk_data.data(), chunk_data.length(), (off_t)(range.first - sector) * config.sector_size) <= 0)
 				throw(hard_exception("i/o error in read"));
 
-			EVP_DigestUpdate(hash_ctx, sector_buffer, config.sector_size);
+			if(!config.delta_write)
+				EVP_DigestUpdate(hash_ctx, chunk_data.data(), chunk_data.length());
+		};
 
-			retries += util.write_sector(current, std::string((const char *)sector_buffer, sizeof(sector_buffer)),
-					sectors_written, sectors_erased, sectors_skipped, simulate);
+		// the next chunk is read (and compressed, in a worker thread) while the current one is sent
 
-			offset += config.sector_size;
+		for(index = 0; index < chunks.size(); index++)
+		{
+			current = chunks[index].first;
+			chunk = chunks[index].second;
+
+			if(index == 0)
+			{
+				read_chunk(chunks[index], data);
+
+				if(compress)
+					Util::compress_packets(data, config.sector_size, transfer, compressed);
+			}
+			else
+			{
+				data.swap(next_data);
+				compressed.swap(next_compressed);
+			}
+
+			if((index + 1) < chunks.size())
+			{
+				read_chunk(chunks[index + 1], next_data);
+
+				if(compress)
+					compressor = boost::thread([&]() { Util::compress_packets(next_data, config.sector_size, transfer, next_compressed); });
+			}
+
+			retries += util.write_sectors(current, data, sectors_written, sectors_erased, sectors_skipped, simulate, compress ? &compressed : nullptr);
+
+			if(compressor.joinable())
+				compressor.join();
+
+			for(packet = 0; packet < compressed.size(); packet++)
+				oob_sent += compressed[packet].empty() ?
+						std::min((size_t)transfer * config.sector_size, data.length() - (packet * transfer * config.sector_size)) : compressed[packet].length();
+
+			offset += data.length();
+			sectors_sent += chunk;
 
 			int seconds, useconds;
 			double duration, rate;
@@ -212,8 +317,8 @@ void Espif::write(const std::string filename, int sector, bool simulate, bool ot
 			rate = offset / 1024.0 / duration;
 
 			std::cout << boost::format("sent %4u kbytes in %2.0f seconds at rate %3.0f kbytes/s, sent %3u sectors, written %3u sectors, erased %3u sectors, skipped %3u sectors, retries %2u, %3u%%     \r") %
-					(offset / 1024) % duration % rate % (current - sector + 1) % sectors_written % sectors_erased % sectors_skipped % retries %
-					(((offset + config.sector_size) * 100) / (length * config.sector_size));
+					(offset / 1024) % duration % rate % sectors_sent % sectors_written % sectors_erased % sectors_skipped % retries %
+					((offset * 100) / (sectors_changed * config.sector_size));
 			std::cout.flush();
 		}
 	}
@@ -221,6 +326,9 @@ void Espif::write(const std::string filename, int sector, bool simulate, bool ot
 	{
 		std::cout << std::endl;
 
+		if(compressor.joinable())
+			compressor.join();
+
 		close(file_fd);
 		throw;
 	}
@@ -229,6 +337,12 @@ void Espif::write(const std::string filename, int sector, bool simulate, bool ot
 
 	std::cout << std::endl;
 
+	if(config.verbose)
+		std::cout << boost::format("rtt: %s, %s") % channel.rtt_text() % channel.pacing_text() << std::endl;
+
+	if(config.verbose && compress)
+		std::cout << boost::format("oob compression: sent %u kbytes for %u kbytes") % (oob_sent / 1024) % (offset / 1024) << std::endl;
+
 	if(simulate)
 		std::cout << "simulate finished" << std::endl;
 	else
@@ -262,7 +376,7 @@ void Espif::verify(const std::string &filename, int sector) const
 	std::vector<std::string> string_value;
 	std::string local_data, remote_data;
 	struct stat stat;
-	uint8_t sector_buffer[config.sector_size];
+	unsigned int chunk_sectors, chunk, chunk_sector;
 	int retries;
 
 	if(filename.empty())
@@ -275,6 +389,22 @@ void Espif::verify(const std::string &filename, int sector) const
 	sectors = (stat.st_size + (config.sector_size - 1)) / config.sector_size;
 	offset = 0;
 
+	if(config.checksum_verify)
+	{
+		try
+		{
+			verify_checksum(file_fd, sector, sectors);
+		}
+		catch(...)
+		{
+			close(file_fd);
+			throw;
+		}
+
+		close(file_fd);
+		return;
+	}
+
 	try
 	{
 		gettimeofday(&time_start, 0);
@@ -283,22 +413,24 @@ void Espif::verify(const std::string &filename, int sector) const
 			std::cout << boost::format("start verify from 0x%x (%u), length 0x%x (%u)") % (sector * config.sector_size) % sector % (sectors * config.sector_size) % sectors << std::endl;
 
 		retries = 0;
+		chunk_sectors = transfer_chunk();
 
-		for(current = sector; current < (sector + sectors); current++)
+		for(current = sector; current < (sector + sectors); current += chunk)
 		{
-			memset(sector_buffer, 0xff, config.sector_size);
+			chunk = std::min(chunk_sectors, (unsigned int)(sector + sectors - current));
+			local_data.assign(chunk * config.sector_size, 0xff);
 
-			if(::read(file_fd, sector_buffer, sizeof(sector_buffer)) <= 0)
+			if(::read(file_fd, local_data.data(), local_data.length()) <= 0)
 				throw(hard_exception("i/o error in read"));
 
-			local_data.assign((const char *)sector_buffer, sizeof(sector_buffer));
+			retries += util.read_sectors(current, chunk, remote_data);
 
-			retries += util.read_sector(config.sector_size, current, remote_data);
+			for(chunk_sector = 0; chunk_sector < chunk; chunk_sector++)
+				if(local_data.compare(chunk_sector * config.sector_size, config.sector_size,
+							remote_data, chunk_sector * config.sector_size, config.sector_size))
+					throw(hard_exception(boost::format("data mismatch, sector %u") % (current + chunk_sector)));
 
-			if(local_data != remote_data)
-				throw(hard_exception(boost::format("data mismatch, sector %u") % current));
-
-			offset += sizeof(sector_buffer);
+			offset += local_data.length();
 
 			int seconds, useconds;
 			double duration, rate;
@@ -311,7 +443,7 @@ void Espif::verify(const std::string &filename, int sector) const
 			rate = offset / 1024.0 / duration;
 
 			std::cout << boost::format("received %3u kbytes in %2.0f seconds at rate %3.0f kbytes/s, received %3u sectors, retries %2u, %3u%%     \r") %
-					(offset / 1024) % duration % rate % (current - sector) % retries % ((offset * 100) / (sectors * config.sector_size));
+					(offset / 1024) % duration % rate % (current - sector + chunk) % retries % ((offset * 100) / (sectors * config.sector_size));
 			std::cout.flush();
 		}
 	}
@@ -324,7 +456,96 @@ void Espif::verify(const std::string &filename, int sector) const
 
 	close(file_fd);
 
-	std::cout << std::endl << "verify OK" << std::endl;
+	std::cout << std::endl;
+
+	if(config.verbose)
+		std::cout << boost::format("rtt: %s, %s") % channel.rtt_text() % channel.pacing_text() << std::endl;
+
+	std::cout << "verify OK" << std::endl;
+}
+
+// one flash-checksum over the whole range, which is all it takes if the flash is correct,
+// otherwise bisect the range that differs until single sectors are left
+
+void Espif::verify_checksum(int file_fd, int sector, int sectors) const
+{
+	std::string data;
+	std::vector<unsigned int> mismatches;
+	unsigned int round_trips;
+
+	data.assign(sectors * config.sector_size, 0xff);
+
+	if((sectors > 0) && (::read(file_fd, data.data(), data.length()) <= 0))
+		throw(hard_exception("i/o error in read"));
+
+	std::cout << boost::format("checksum verify %u sectors from sector %u...") % sectors % sector << std::endl;
+
+	round_trips = 0;
+
+	if(sectors > 0)
+		verify_bisect(data, sector, 0, sectors, false, mismatches, round_trips);
+
+	if(config.verbose)
+		std::cout << boost::format("round trips: %u, rtt: %s, %s") % round_trips % channel.rtt_text() % channel.pacing_text() << std::endl;
+
+	if(!mismatches.empty())
+	{
+		for(const auto &mismatch : mismatches)
+			std::cout << boost::format("! sector %u, address 0x%06x: checksum differs") % mismatch % (mismatch * config.sector_size) << std::endl;
+
+		throw(hard_exception(boost::format("data mismatch, %u sectors differ") % mismatches.size()));
+	}
+
+	std::cout << "verify OK" << std::endl;
+}
+
+// if the first half of a range that differs is OK, the second half must differ, that one isn't checked then
+
+void Espif::verify_bisect(const std::string &data, int sector, unsigned int first, unsigned int count, bool known_different,
+		std::vector<unsigned int> &mismatches, unsigned int &round_trips) const
+{
+	unsigned char hash[sha1_hash_size];
+	unsigned int hash_size, half;
+	std::string remote_hash_text;
+	size_t before;
+
+	if(!known_different)
+	{
+		hash_size = sha1_hash_size;
+		EVP_Digest(data.data() + (first * config.sector_size), count * config.sector_size, hash, &hash_size, EVP_sha1(), (ENGINE *)0);
+
+		util.get_checksum(sector + first, count, remote_hash_text);
+		round_trips++;
+
+		if(Util::sha1_hash_to_text(sha1_hash_size, hash) == remote_hash_text)
+			return;
+	}
+
+	if(count == 1)
+	{
+		mismatches.push_back(sector + first);
+		return;
+	}
+
+	half = count / 2;
+	before = mismatches.size();
+
+	verify_bisect(data, sector, first, half, false, mismatches, round_trips);
+	verify_bisect(data, sector, first + half, count - half, mismatches.size() == before, mismatches, round_trips);
+}
+
+unsigned int Espif::transfer_chunk() const
+{
+	unsigned int chunk;
+
+	// sectors handed to Util in one go, enough to keep the window full for a while
+
+	chunk = std::max(config.transfer_sectors, 1U);
+
+	if(config.window > 1)
+		chunk *= config.window * window_chunk_windows;
+
+	return(chunk);
 }
 
 void Espif::benchmark(int length) const
@@ -378,6 +599,187 @@ void Espif::benchmark(int length) const
 
 		usleep(200000);
 		std::cout << std::endl;
+
+		if(config.verbose)
+			std::cout << boost::format("rtt: %s, %s") % channel.rtt_text() % channel.pacing_text() << std::endl;
+	}
+}
+
+// the same round trips over the poll and the io_uring backend, with the cpu time used for each
+
+void Espif::benchmark_backends(int length) const
+{
+	enum { iterations = 4096 };
+	static const char *backend_name[2] = { "poll", "io_uring" };
+	unsigned int backend, current, retries;
+	std::string command;
+	std::string expect;
+	std::string reply;
+	std::string_view reply_oob;
+	struct rusage usage_start, usage_end;
+	uint64_t time_start, time_end, cpu_usec;
+
+	command = (boost::format("flash-bench %u") % length).str();
+	expect = (boost::format("OK flash-bench: sending %u bytes") % length).str();
+
+	for(backend = 0; backend < 2; backend++)
+	{
+		EspifConfig backend_config = config;
+		backend_config.io_uring = (backend == 1);
+		GenericSocket backend_channel(backend_config);
+		Util backend_util(backend_channel, backend_config);
+		Packet reply_packet;
+
+		if(backend_config.io_uring && !backend_channel.uring)
+		{
+			std::cout << boost::format("%-8s not available") % backend_name[backend] << std::endl;
+			continue;
+		}
+
+		retries = 0;
+		getrusage(RUSAGE_SELF, &usage_start);
+		time_start = Util::time_usec();
+
+		for(current = 0; current < iterations; current++)
+		{
+			retries += backend_util.process(command, "", reply_packet, reply, &reply_oob, expect.c_str());
+
+			if(reply_oob.length() != (unsigned int)length)
+				throw(transient_exception(boost::format("benchmark backends: incorrect length (%u vs. %u)") % reply_oob.length() % length));
+		}
+
+		time_end = Util::time_usec();
+		getrusage(RUSAGE_SELF, &usage_end);
+
+		cpu_usec = ((usage_end.ru_utime.tv_sec - usage_start.ru_utime.tv_sec) * 1000000ULL) + (usage_end.ru_utime.tv_usec - usage_start.ru_utime.tv_usec) +
+				((usage_end.ru_stime.tv_sec - usage_start.ru_stime.tv_sec) * 1000000ULL) + (usage_end.ru_stime.tv_usec - usage_start.ru_stime.tv_usec);
+
+		std::cout << boost::format("%-8s %u transactions of %u bytes in %.0f ms, %.1f us per transaction, cpu time %.1f us per transaction, retries %u") %
+				backend_name[backend] % iterations % length % ((time_end - time_start) / 1000.0) % ((double)(time_end - time_start) / iterations) %
+				((double)cpu_usec / iterations) % retries << std::endl;
+	}
+}
+
+// round trip latency distribution, sleeping in poll() vs. spinning first, see GenericSocket::receive_spin
+
+void Espif::benchmark_latency(int length) const
+{
+	enum { iterations = 4096, busy_poll_default_usec = 200 };
+	static const char *mode_name[2] = { "poll", "busy poll" };
+	unsigned int mode, current, retries;
+	std::string command;
+	std::string expect;
+	std::string reply;
+	std::string_view reply_oob;
+	std::vector<uint64_t> latency;
+	uint64_t start;
+
+	command = (boost::format("flash-bench %u") % length).str();
+	expect = (boost::format("OK flash-bench: sending %u bytes") % length).str();
+
+	for(mode = 0; mode < 2; mode++)
+	{
+		EspifConfig mode_config = config;
+		mode_config.busy_poll_usec = (mode == 0) ? 0 : (config.busy_poll_usec > 0 ? config.busy_poll_usec : (unsigned int)busy_poll_default_usec);
+		GenericSocket mode_channel(mode_config);
+		Util mode_util(mode_channel, mode_config);
+		Packet reply_packet;
+
+		retries = 0;
+		latency.clear();
+
+		for(current = 0; current < iterations; current++)
+		{
+			start = Util::time_usec();
+			retries += mode_util.process(command, "", reply_packet, reply, &reply_oob, expect.c_str());
+			latency.push_back(Util::time_usec() - start);
+
+			if(reply_oob.length() != (unsigned int)length)
+				throw(transient_exception(boost::format("benchmark latency: incorrect length (%u vs. %u)") % reply_oob.length() % length));
+		}
+
+		std::sort(latency.begin(), latency.end());
+
+		std::cout << boost::format("%-9s (%3u us) %u transactions of %u bytes, latency p50 %u us, p99 %u us, max %u us, retries %u") %
+				mode_name[mode] % mode_config.busy_poll_usec % iterations % length %
+				latency[iterations / 2] % latency[(iterations * 99) / 100] % latency.back() % retries << std::endl;
+	}
+}
+
+// goodput and retries over a range of fault scenarios, see fault_injector.h, every scenario reads
+// the same sectors and writes them back in simulate mode (compare only, nothing is erased or written),
+// data that differs from the fault free read means corruption got through the checksums
+
+void Espif::benchmark_faults(int sector) const
+{
+	enum { sectors = 64 };
+	static const char *scenarios_builtin[] =
+	{
+		"",
+		"loss=0.01",
+		"loss=0.05",
+		"loss=0.1",
+		"loss=0.2",
+		"duplicate=0.1",
+		"reorder=0.1",
+		"delay=5,jitter=10",
+		"corrupt=0.01",
+		"loss=0.05,duplicate=0.02,reorder=0.05,delay=2,jitter=4,corrupt=0.01",
+	};
+	std::vector<std::string> scenarios;
+	std::string reference, data;
+	unsigned int written, erased, skipped, mismatches, current;
+	int retries;
+	uint64_t start, duration;
+
+	EspifConfig scenario_config = config;
+
+	if(config.faults.empty())
+		scenarios.assign(std::begin(scenarios_builtin), std::end(scenarios_builtin));
+	else
+		scenarios = { "", config.faults };
+
+	for(const auto &scenario : scenarios)
+	{
+		scenario_config.faults = scenario;
+		GenericSocket scenario_channel(scenario_config);
+		Util scenario_util(scenario_channel, scenario_config);
+
+		written = erased = skipped = mismatches = 0;
+		retries = 0;
+		start = Util::time_usec();
+
+		try
+		{
+			retries += scenario_util.read_sectors(sector, sectors, data);
+			retries += scenario_util.write_sectors(sector, reference.empty() ? data : reference, written, erased, skipped, true);
+		}
+		catch(const espif_exception &e)
+		{
+			if(reference.empty())
+				throw(hard_exception(boost::format("benchmark faults: no fault free reference: %s") % e.what()));
+
+			std::cout << boost::format("%-48s failed: %s") % scenario % e.what() << std::endl;
+			continue;
+		}
+
+		duration = Util::time_usec() - start;
+
+		if(reference.empty())
+			reference = data;
+
+		for(current = 0; current < sectors; current++)
+			if(data.compare(current * config.sector_size, config.sector_size, reference, current * config.sector_size, config.sector_size))
+				mismatches++;
+
+		mismatches += written;
+
+		std::cout << boost::format("%-48s %5.0f kbytes/s, %4.0f ms, retries %3d, mismatches %u") %
+				(scenario.empty() ? "none" : scenario) % ((2.0 * sectors * config.sector_size / 1024) / (duration / 1000000.0)) %
+				(duration / 1000.0) % retries % mismatches << std::endl;
+
+		if(config.verbose && scenario_channel.faults)
+			std::cout << boost::format("    %s") % scenario_channel.faults->statistics_text() << std::endl;
 	}
 }
 
@@ -436,6 +838,7 @@ void Espif::image(int image_slot, const std::string &filename,
 {
 	struct timeval time_start, time_now;
 	int current_sector;
+	unsigned int chunk;
 
 	gettimeofday(&time_start, 0);
 
@@ -447,6 +850,10 @@ void Espif::image(int image_slot, const std::string &filename,
 		else
 			current_sector = -1;
 
+	// flash slots are written per sector, the display takes any length, so use the largest payload the device takes
+
+	chunk = (current_sector < 0) ? util.payload_size() : config.sector_size;
+
 	try
 	{
 		Magick::InitializeMagick(nullptr);
@@ -457,7 +864,7 @@ void Espif::image(int image_slot, const std::string &filename,
 		const Magick::Quantum *pixel_cache;
 
 		std::string reply;
-		unsigned char sector_buffer[config.sector_size];
+		std::vector<unsigned char> sector_buffer(chunk);
 		unsigned int start_x, start_y;
 		unsigned int current_buffer, x, y;
 		double r, g, b;
@@ -494,7 +901,7 @@ void Espif::image(int image_slot, const std::string &filename,
 		start_x = 0;
 		start_y = 0;
 
-		memset(sector_buffer, 0xff, config.sector_size);
+		memset(sector_buffer.data(), 0xff, chunk);
 
 		for(y = 0; y < dim_y; y++)
 		{
@@ -508,10 +915,10 @@ void Espif::image(int image_slot, const std::string &filename,
 				{
 					case(1):
 					{
-						if((current_buffer / 8) + 1 > config.sector_size)
+						if((current_buffer / 8) + 1 > chunk)
 						{
-							image_send_sector(current_sector, std::string((const char *)sector_buffer, current_buffer / 8), start_x, start_y, depth);
-							memset(sector_buffer, 0xff, config.sector_size);
+							image_send_sector(current_sector, std::string((const char *)sector_buffer.data(), current_buffer / 8), start_x, start_y, depth);
+							memset(sector_buffer.data(), 0xff, chunk);
 							current_buffer -= (current_buffer / 8) * 8;
 						}
 
@@ -530,10 +937,10 @@ void Espif::image(int image_slot, const std::string &filename,
 						unsigned int ru16, gu16, bu16;
 						unsigned int r1, g1, g2, b1;
 
-						if((current_buffer + 2) > config.sector_size)
+						if((current_buffer + 2) > chunk)
 						{
-							image_send_sector(current_sector, std::string((const char *)sector_buffer, current_buffer), start_x, start_y, depth);
-							memset(sector_buffer, 0xff, config.sector_size);
+							image_send_sector(current_sector, std::string((const char *)sector_buffer.data(), current_buffer), start_x, start_y, depth);
+							memset(sector_buffer.data(), 0xff, chunk);
 
 							if(current_sector >= 0)
 								current_sector++;
@@ -560,10 +967,10 @@ void Espif::image(int image_slot, const std::string &filename,
 
 					case(24):
 					{
-						if((current_buffer + 3) > config.sector_size)
+						if((current_buffer + 3) > chunk)
 						{
-							image_send_sector(current_sector, std::string((const char *)sector_buffer, current_buffer), start_x, start_y, depth);
-							memset(sector_buffer, 0xff, config.sector_size);
+							image_send_sector(current_sector, std::string((const char *)sector_buffer.data(), current_buffer), start_x, start_y, depth);
+							memset(sector_buffer.data(), 0xff, chunk);
 
 							if(current_sector >= 0)
 								current_sector++;
@@ -604,7 +1011,7 @@ void Espif::image(int image_slot, const std::string &filename,
 				current_buffer /= 8;
 			}
 
-			image_send_sector(current_sector, std::string((const char *)sector_buffer, current_buffer), start_x, start_y, depth);
+			image_send_sector(current_sector, std::string((const char *)sector_buffer.data(), current_buffer), start_x, start_y, depth);
 		}
 
 		std::cout << std::endl;
@@ -1204,14 +1611,9 @@ void Espif::image_epaper(const std::string &filename) const
 
 std::string Espif::send(std::string args) const
 {
-	std::string arg;
-	size_t current;
-	Packet send_packet;
-	std::string send_data;
-	Packet receive_packet;
-	std::string receive_data;
-	std::string reply;
-	std::string reply_oob;
+	std::vector<std::string> commands;
+	std::vector<Util::CommandReply> replies;
+	size_t current, index;
 	std::string output;
 	int retries;
 
@@ -1228,26 +1630,38 @@ std::string Espif::send(std::string args) const
 	{
 		if((current = args.find('\n')) != std::string::npos)
 		{
-			arg = args.substr(0, current);
+			commands.push_back(args.substr(0, current));
 			args.erase(0, current + 1);
 		}
 		else
 		{
-			arg = args;
+			commands.push_back(args);
 			args.clear();
 		}
+	}
+
+	// all commands in one or a few packets, if the firmware supports it, otherwise one round trip per command
+
+	retries = util.process_multi(commands, replies);
+
+	for(index = 0; index < replies.size(); index++)
+	{
+		const auto &reply = replies[index];
+
+		output.append(reply.data);
 
-		retries = util.process(arg, "", reply, &reply_oob);
+		// the firmware reports a failed command in a multi command packet by status only
 
-		output.append(reply);
+		if(reply.status != multi_command_status_ok)
+			output.append((boost::format("\n! command \"%s\" failed, status %u") % commands[index] % reply.status).str());
 
-		if(reply_oob.length() > 0)
+		if(reply.oob_data.length() > 0)
 		{
 			unsigned int length = 0;
 
-			output.append((boost::format("\n%u bytes of OOB data: ") % reply_oob.length()).str());
+			output.append((boost::format("\n%u bytes of OOB data: ") % reply.oob_data.length()).str());
 
-			for(const auto &it : reply_oob)
+			for(const auto &it : reply.oob_data)
 			{
 				if((length++ % 20) == 0)
 					output.append("\n    ");
@@ -1258,137 +1672,208 @@ std::string Espif::send(std::string args) const
 		}
 
 		output.append("\n");
+	}
 
-		if((retries > 0) && config.verbose)
+	if(config.verbose)
+	{
+		if(retries > 0)
 			std::cout << boost::format("%u retries\n") % retries;
+
+		std::cout << boost::format("rtt: %s, %s\n") % channel.rtt_text() % channel.pacing_text();
 	}
 
 	return(output);
 }
 
 std::string Espif::multicast(const std::string &args)
+{
+	return(multicast(args, nullptr));
+}
+
+// collect replies until none arrived for the quiet period, or until all expected hosts (--hosts) replied,
+// in which case the probes of the burst that aren't sent yet are skipped, the summary shows how many went out,
+// the quiet period is learned from the replies: the longer of the first reply's delay and four times the
+// largest gap between replies, so a fast network ends the scan quickly and a slow one isn't cut short,
+// when stream is set, it gets one line for every host, as soon as its first reply arrives,
+// the returned string then only has the summary
+
+std::string Espif::multicast(const std::string &args, const std::function<void (const std::string &)> &stream)
 {
 	Packet send_packet(args);
 	Packet receive_packet;
-	std::string send_data;
-	std::string receive_data;
-	std::string reply_data;
+	std::string_view reply_data;
+	std::string_view reply_oob_data;
+	std::vector<std::string_view> messages;
+	std::vector<struct sockaddr_in> remote_hosts;
 	std::string packet;
-	struct timeval tv_start, tv_now;
-	uint64_t start, now;
-	struct sockaddr_in remote_host;
-	char host_buffer[64];
-	char service[64];
-	std::string hostname;
-	int gai_error;
-	std::string reply;
-	std::string info;
-	std::string line;
+	std::string send_data;
+	uint64_t start, now, deadline, last_reply, first_reply_delay, largest_gap, quiet;
+	std::vector<uint32_t> host_ids;
 	uint32_t host_id;
 	typedef struct { int count; std::string hostname; std::string text; } multicast_reply_t;
 	typedef std::map<unsigned uint32_t, multicast_reply_t> multicast_replies_t;
 	multicast_replies_t multicast_replies;
-	int total_replies, total_hosts;
-	int run;
+	unsigned int total_replies, total_hosts;
+	unsigned int ix, received, burst, probes;
+	uint64_t next_probe;
 	uint32_t transaction_id;
+	std::string hostname;
 	std::string output;
 
 	transaction_id = prn();
 	packet = send_packet.encapsulate(config.raw, config.provide_checksum, config.request_checksum, config.broadcast_group_mask, &transaction_id);
 
+	// the probes of a burst go out a few ms apart, copies sent at the same moment get lost together on wifi,
+	// the replies are taken in batches by recvmmsg in between, with hundreds of devices
+	// a single reply per system call can't keep up and the socket queue overflows
+
+	burst = std::max(config.multicast_burst, 1U);
+
 	if(config.dontwait)
 	{
-		for(run = 0; run < (int)config.multicast_burst; run++)
+		for(probes = 0; probes < burst; probes++)
 		{
+			if(probes > 0)
+				usleep(multicast_probe_spacing_msec * 1000);
+
 			send_data = packet;
-			channel.send(send_data);
-			usleep(100000);
+
+			if(!channel.send(send_data))
+				throw(transient_exception("multicast: send failed"));
 		}
 
 		return(std::string(""));
 	}
 
-	total_replies = total_hosts = 0;
+	// only multicast needs the names, don't read ~/.espif-names for anything else
+
+	if(!name_cache)
+		name_cache = new NameCache(config);
 
-	gettimeofday(&tv_start, nullptr);
-	start = (tv_start.tv_sec * 1000000) + tv_start.tv_usec;
+	total_replies = total_hosts = 0;
+	start = Util::time_usec();
+	last_reply = 0;
+	first_reply_delay = 0;
+	largest_gap = 0;
+	quiet = multicast_quiet_min_msec * 1000ULL;
+	probes = 0;
+	next_probe = start;
 
-	for(run = 0; run < (int)config.multicast_burst; run++)
+	for(;;)
 	{
-		gettimeofday(&tv_now, nullptr);
-		now = (tv_now.tv_sec * 1000000) + tv_now.tv_usec;
+		now = Util::time_usec();
+
+		if((probes < burst) && (now >= next_probe))
+		{
+			send_data = packet;
+
+			if(!channel.send(send_data))
+				throw(transient_exception("multicast: send failed"));
 
-		if(((now - start) / 1000ULL) > 10000)
+			probes++;
+			next_probe = now + (multicast_probe_spacing_msec * 1000ULL);
+		}
+
+		if((now - start) >= (multicast_window_max_msec * 1000ULL))
 			break;
 
-		send_data = packet;
-		channel.send(send_data, 100);
+		if(last_reply == 0)
+			deadline = start + (multicast_first_reply_msec * 1000ULL);
+		else
+			deadline = last_reply + quiet;
 
-		for(;;)
+		if(probes < burst)
 		{
-			reply_data.clear();
-
-			if(!channel.receive(reply_data, 100, &remote_host))
+			if((now >= deadline) || (next_probe < deadline))
+				deadline = next_probe;
+		}
+		else
+			if(now >= deadline)
 				break;
 
-			receive_packet.clear();
-			receive_packet.append_data(reply_data);
-
-			if(!receive_packet.decapsulate(&reply_data, nullptr, config.verbose, nullptr, &transaction_id))
-			{
-				if(config.verbose)
-					std::cout << "multicast: cannot decapsulate" << std::endl;
+		if((received = channel.receive_batch(messages, remote_hosts, (deadline - now + 999) / 1000)) == 0)
+			continue;
 
-				continue;
-			}
+		now = Util::time_usec();
 
-			host_id = ntohl(remote_host.sin_addr.s_addr);
+		if(last_reply == 0)
+			first_reply_delay = now - start;
+		else
+			largest_gap = std::max(largest_gap, now - last_reply);
 
-			gai_error = getnameinfo((struct sockaddr *)&remote_host, sizeof(remote_host), host_buffer, sizeof(host_buffer),
-					service, sizeof(service), NI_DGRAM | NI_NUMERICSERV | NI_NOFQDN);
+		last_reply = now;
+		quiet = std::max(first_reply_delay, largest_gap * 4);
+		quiet = std::clamp(quiet, (uint64_t)multicast_quiet_min_msec * 1000, (uint64_t)multicast_quiet_max_msec * 1000);
 
-			if(gai_error != 0)
+		for(ix = 0; ix < received; ix++)
+		{
+			if(!util.codec.decapsulate(receive_packet, messages[ix], reply_data, reply_oob_data, config.verbose, nullptr, &transaction_id))
 			{
 				if(config.verbose)
-					std::cout << boost::format("cannot resolve: %s") % gai_strerror(gai_error) << std::endl;
+					std::cout << "multicast: cannot decapsulate" << std::endl;
 
-				hostname = "0.0.0.0";
+				continue;
 			}
-			else
-				hostname = host_buffer;
+
+			host_id = ntohl(remote_hosts[ix].sin_addr.s_addr);
 
 			total_replies++;
 
 			auto it = multicast_replies.find(host_id);
 
 			if(it != multicast_replies.end())
+			{
 				it->second.count++;
-			else
+				continue;
+			}
+
+			total_hosts++;
+			multicast_reply_t entry;
+
+			entry.count = 1;
+			entry.text = reply_data;
+			multicast_replies[host_id] = entry;
+			host_ids.push_back(host_id);
+
+			// don't wait for dns here, only use a name that's already known
+
+			if(stream)
 			{
-				total_hosts++;
-				multicast_reply_t entry;
+				if(!name_cache->lookup(host_id, hostname))
+					hostname = Util::ip_text(host_id);
 
-				entry.count = 1;
-				entry.hostname = hostname;
-				entry.text = reply_data;
-				multicast_replies[host_id] = entry;
+				stream((boost::format("%-14s %-12s %s\n") % Util::ip_text(host_id) % hostname % entry.text).str());
 			}
 		}
+
+		// everyone answered, the remaining probes can't bring anything new
+
+		if((config.multicast_hosts > 0) && (total_hosts >= config.multicast_hosts))
+			break;
 	}
 
-	for(auto &it : multicast_replies)
+	if(config.verbose)
+		std::cout << boost::format("multicast: collected for %u ms, first reply after %u ms, largest gap %u ms, quiet period %u ms") %
+				((Util::time_usec() - start) / 1000) % (first_reply_delay / 1000) % (largest_gap / 1000) % (quiet / 1000) << std::endl;
+
+	// names are resolved after collection, a slow resolver would otherwise let the replies overflow the socket queue
+
+	name_cache->resolve(host_ids);
+	name_cache->save();
+
+	if(!stream)
 	{
-		boost::format ip("%u.%u.%u.%u");
+		for(auto &it : multicast_replies)
+		{
+			name_cache->lookup(it.first, it.second.hostname);
 
-		ip % ((it.first & 0xff000000) >> 24) %
-				((it.first & 0x00ff0000) >> 16) %
-				((it.first & 0x0000ff00) >>  8) %
-				((it.first & 0x000000ff) >>  0);
+			output.append((boost::format("%-14s %2u %-12s %s\n") % Util::ip_text(it.first) % it.second.count % it.second.hostname % it.second.text).str());
+		}
 
-		output.append((boost::format("%-14s %2u %-12s %s\n") % ip % it.second.count % it.second.hostname % it.second.text).str());
+		output.append("\n");
 	}
 
-	output.append((boost::format("\n%u probes sent, %u replies received, %u hosts\n") % config.multicast_burst % total_replies % total_hosts).str());
+	output.append((boost::format("%u probes sent, %u replies received, %u hosts\n") % probes % total_replies % total_hosts).str());
 
 	return(output);
 }
@@ -1428,6 +1913,7 @@ void Espif::commit_ota(unsigned int flash_slot, unsigned int sector, bool reset,
 	channel.send(send_data);
 	channel.disconnect();
 	channel.connect();
+	util.reset_negotiation();
 	util.process("flash-info", "", reply, nullptr, flash_info_expect, &string_value, &int_value);
 	std::cout << "reboot finished" << std::endl;
 	util.process("flash-info", "", reply, nullptr, flash_info_expect, &string_value, &int_value);
@@ -4,10 +4,12 @@
 #include "espifconfig.h"
 #include "generic_socket.h"
 #include "util.h"
+#include "name_cache.h"
 
 #include <string>
 #include <map>
 #include <deque>
+#include <functional>
 
 #include <boost/random/mersenne_twister.hpp>
 #include <boost/random/uniform_int_distribution.hpp>
@@ -17,6 +19,7 @@ class Espif
 	public:
 
 		Espif() = delete;
+		Espif(const Espif &) = delete;
 		Espif(const EspifConfig &);
 		~Espif();
 
@@ -24,6 +27,9 @@ class Espif
 		void write(const std::string filename, int sector, bool simulate, bool otawrite) const;
 		void verify(const std::string &filename, int sector) const;
 		void benchmark(int length) const;
+		void benchmark_backends(int length) const;
+		void benchmark_latency(int length) const;
+		void benchmark_faults(int sector) const;
 		void image(int image_slot, const std::string &filename,
 				unsigned int dim_x, unsigned int dim_y, unsigned int depth, int image_timeout) const;
 #ifdef SWIG
@@ -34,6 +40,9 @@ class Espif
 		void image_epaper(const std::string &filename) const;
 		std::string send(std::string args) const;
 		std::string multicast(const std::string &args);
+#ifndef SWIG
+		std::string multicast(const std::string &args, const std::function<void (const std::string &)> &stream);
+#endif
 		void commit_ota(unsigned int flash_slot, unsigned int sector, bool reset, bool notemp);
 		int process(const std::string &data, const std::string &oob_data,
 				std::string &reply_data, std::string *reply_oob_data,
@@ -43,6 +52,15 @@ class Espif
 
 		static constexpr const char *dbus_service_id = "name.slagter.erik.espproxy";
 
+		enum
+		{
+			multicast_first_reply_msec = 100,
+			multicast_probe_spacing_msec = 5,
+			multicast_quiet_min_msec = 10,
+			multicast_quiet_max_msec = 100,
+			multicast_window_max_msec = 10000,
+		};
+
 		class ProxySensorDataKey
 		{
 			public:
@@ -100,12 +118,17 @@ class Espif
 		const EspifConfig config;
 		GenericSocket channel;
 		const Util util;
+		NameCache *name_cache;
 		boost::random::mt19937 prn;
 		ProxySensorData proxy_sensor_data;
 		ProxyCommands proxy_commands;
 		std::string uart_data;
 		ProxyThread *proxy_thread_class;
 
+		unsigned int transfer_chunk() const;
+		void verify_checksum(int file_fd, int sector, int sectors) const;
+		void verify_bisect(const std::string &data, int sector, unsigned int first, unsigned int count, bool known_different,
+				std::vector<unsigned int> &mismatches, unsigned int &round_trips) const;
 		void image_send_sector(int current_sector, const std::string &data,
 				unsigned int current_x, unsigned int current_y, unsigned int depth) const;
 		void cie_spi_write(const std::string &data, const char *match) const;
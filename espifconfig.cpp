@@ -1 +1,7 @@
 #include "espifconfig.h"
+
+// out of line, too large to be inlined everywhere a configuration is copied
+
+EspifConfig::~EspifConfig() noexcept
+{
+}
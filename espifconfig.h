@@ -7,6 +7,13 @@ class EspifConfig
 {
 	public:
 
+		enum
+		{
+			transfer_sectors_max = 256,
+		};
+
+		~EspifConfig() noexcept;
+
 		std::string host;
 		std::string command_port = "24";
 		bool use_tcp = false;
@@ -17,10 +24,24 @@ class EspifConfig
 		bool dontwait = false;
 		unsigned int broadcast_group_mask = 0;
 		unsigned int multicast_burst = 3;
+		unsigned int multicast_hosts = 0;
 		bool raw = false;
 		bool provide_checksum = true;
 		bool request_checksum = true;
 		unsigned int sector_size = 4096;
+		unsigned int window = 1;
+		bool pacing = true;
+		unsigned int transfer_sectors = 1;
+		unsigned int packet_version = 3;
+		bool crc32c = true;
+		bool io_uring = false;
+		bool multi_command = true;
+		unsigned int busy_poll_usec = 0;
+		bool payload_probe = false;
+		std::string faults;
+		bool oob_compression = false;
+		bool delta_write = false;
+		bool checksum_verify = false;
 };
 
 #endif
@@ -0,0 +1,99 @@
+#include "event_loop.h"
+#include "util.h"
+#include "exception.h"
+
+#include <vector>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+EventLoop::EventLoop()
+{
+	if((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		throw(hard_exception("event loop: epoll_create failed"));
+}
+
+EventLoop::~EventLoop() noexcept
+{
+	close(epoll_fd);
+}
+
+void EventLoop::add(int fd, Handler *handler)
+{
+	struct epoll_event event;
+
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.ptr = handler;
+
+	if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event))
+		throw(hard_exception(boost::format("event loop: cannot add fd %d: %s") % fd % strerror(errno)));
+}
+
+void EventLoop::remove(int fd) noexcept
+{
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+void EventLoop::timer(Handler *handler, uint64_t deadline_usec)
+{
+	cancel(handler);
+
+	handler->deadline = deadline_usec;
+	timers.insert(std::make_pair(deadline_usec, handler));
+}
+
+void EventLoop::cancel(Handler *handler) noexcept
+{
+	if(handler->deadline == 0)
+		return;
+
+	timers.erase(std::make_pair(handler->deadline, handler));
+	handler->deadline = 0;
+}
+
+void EventLoop::run()
+{
+	struct epoll_event events[events_max];
+	std::vector<Handler *> due;
+	uint64_t now;
+	int timeout;
+	int ready, ix;
+
+	while(!timers.empty())
+	{
+		now = Util::time_usec();
+
+		if(timers.begin()->first <= now)
+			timeout = 0;
+		else
+			timeout = (timers.begin()->first - now + 999) / 1000;
+
+		if((ready = epoll_wait(epoll_fd, events, events_max, timeout)) < 0)
+		{
+			if(errno == EINTR)
+				continue;
+
+			throw(hard_exception(boost::format("event loop: epoll_wait failed: %s") % strerror(errno)));
+		}
+
+		for(ix = 0; ix < ready; ix++)
+			((Handler *)events[ix].data.ptr)->readable();
+
+		// collect first, a handler may set a new timer from expired(), if it's already due
+		// it's taken in the next round
+
+		now = Util::time_usec();
+		due.clear();
+
+		while(!timers.empty() && (timers.begin()->first <= now))
+		{
+			due.push_back(timers.begin()->second);
+			cancel(due.back());
+		}
+
+		for(auto &handler : due)
+			handler->expired();
+	}
+}
@@ -0,0 +1,52 @@
+#ifndef _event_loop_h_
+#define _event_loop_h_
+
+#include <set>
+#include <utility>
+#include <stdint.h>
+
+// single threaded event loop, epoll for socket readiness and one timer per handler,
+// run() returns when no handler has a timer pending anymore
+
+class EventLoop
+{
+	friend class Fleet;
+
+	protected:
+
+		class Handler
+		{
+			friend class EventLoop;
+
+			public:
+
+				virtual ~Handler() noexcept = default;
+
+			protected:
+
+				virtual void readable() = 0;
+				virtual void expired() = 0;
+
+			private:
+
+				uint64_t deadline = 0;
+		};
+
+		EventLoop(const EventLoop &) = delete;
+		EventLoop();
+		~EventLoop() noexcept;
+
+		void add(int fd, Handler *handler);
+		void remove(int fd) noexcept;
+		void timer(Handler *handler, uint64_t deadline_usec);
+		void cancel(Handler *handler) noexcept;
+		void run();
+
+	private:
+
+		enum { events_max = 64 };
+
+		int epoll_fd;
+		std::set<std::pair<uint64_t, Handler *>> timers;
+};
+#endif
@@ -0,0 +1,460 @@
+#!/usr/bin/env python3
+#
+# a fake device for testing and benchmarking espif on loopback, no hardware needed
+#
+# speaks the packet format of ota.h (version 2 and 3 headers, md5_32 and crc32c checksums,
+# transaction ids, multi_command, oob compression, raw packets) over udp and, with --tcp, tcp,
+# and implements enough of the flash commands to read, write, verify and commit an image
+# to a 4 MB flash in memory, e.g.
+#
+#	./fake_device.py --port 2424 --multi &
+#	./espif -h 127.0.0.1 -p 2424 --benchmark-faults
+#	./espif -h 127.0.0.1 -p 2424 -W -f image.bin
+#
+# --loss and --delay model a lossy or slow link on the device side, --faults in espif models it on the host side,
+# raw requests with oob data over tcp are not supported, raw requests are cut at the newline
+
+import argparse
+import hashlib
+import random
+import socket
+import struct
+import sys
+import threading
+import time
+
+sector_size = 4096
+flash_sectors = 1024
+
+packet_header_soh = 0x01
+packet_header_version = 2
+packet_header_version_3 = 3
+packet_header_id = 0x4afb
+packet_raw_end = 0x04
+
+flag_md5_32_requested = 1 << 0
+flag_md5_32_provided = 1 << 1
+flag_transaction_id_provided = 1 << 2
+flag_version_3_supported = 1 << 3
+flag_crc32c_requested = 1 << 4
+flag_crc32c_provided = 1 << 5
+flag_multi_command = 1 << 6
+flag_oob_compressed = 1 << 7
+flag_oob_compression_supported = 1 << 8
+
+multi_command_reply_max = 1024
+
+header_2 = struct.Struct("<BBHHHHHHHIIII")
+header_3 = struct.Struct("<BBHHHIIIIII")
+header_checksum_offset = 28
+multi_command_reply = struct.Struct("<HHB3x")
+
+parser = argparse.ArgumentParser(description = "fake device for espif")
+parser.add_argument("--port", type = int, default = 24, help = "udp (and tcp) port to listen on")
+parser.add_argument("--tcp", action = "store_true", help = "listen on tcp too")
+parser.add_argument("--multi", action = "store_true", help = "support version 3, multi sector transfers, multi_command and flash-checksum-list")
+parser.add_argument("--compress", action = "store_true", help = "support oob compression")
+parser.add_argument("--raw-end", action = "store_true", help = "end raw replies with packet_raw_end and their length")
+parser.add_argument("--loss", type = float, default = 0.0, help = "chance a request or a reply is lost")
+parser.add_argument("--delay", type = float, default = 0.0, help = "seconds to wait before every reply, replies are sent one by one")
+parser.add_argument("--max-packet", type = int, default = 0, help = "drop requests larger than this")
+parser.add_argument("--seed", type = int, default = 1, help = "seed for --loss")
+parser.add_argument("--verbose", action = "store_true")
+args = parser.parse_args()
+
+rng = random.Random(args.seed)
+flash = bytearray(b"\xff" * (flash_sectors * sector_size))
+boot = { "current": 0, "selected": 0 }
+counters = { "received": 0, "sent": 0, "lost": 0, "bad checksum": 0 }
+
+def md5_32(data):
+	digest = hashlib.md5(data).digest()
+	return (digest[0] << 24) | (digest[1] << 16) | (digest[2] << 8) | (digest[3] << 0)
+
+crc32c_table = []
+
+for value in range(256):
+	for bit in range(8):
+		value = (value >> 1) ^ (0x82f63b78 if value & 1 else 0)
+	crc32c_table.append(value)
+
+def crc32c(data):
+	crc = 0xffffffff
+	for byte in data:
+		crc = (crc >> 8) ^ crc32c_table[(crc ^ byte) & 0xff]
+	return crc ^ 0xffffffff
+
+# see oob_compression_header_t in ota.h
+
+def decompress(data):
+	length = struct.unpack_from("<I", data, 0)[0]
+	out = bytearray()
+	offset = 4
+
+	while len(out) < length:
+		control = data[offset]
+		offset += 1
+
+		for bit in range(8):
+			if len(out) >= length:
+				break
+
+			if not (control >> bit) & 1:
+				out.append(data[offset])
+				offset += 1
+				continue
+
+			match = data[offset] | (data[offset + 1] << 8)
+			offset += 2
+			distance = (match & 0xfff) + 1
+			count = (match >> 12) + 3
+
+			if count == 18:
+				count += data[offset]
+				offset += 1
+
+			if (distance > len(out)) or (offset > len(data)):
+				raise ValueError("invalid compressed data")
+
+			for _ in range(count):
+				out.append(out[-distance])
+
+	if offset != len(data):
+		raise ValueError("invalid compressed data length")
+
+	return bytes(out)
+
+def compress(data):
+	out = bytearray(struct.pack("<I", len(data)))
+	offset = 0
+	seen = {}
+
+	while offset < len(data):
+		control = len(out)
+		out.append(0)
+
+		for bit in range(8):
+			if offset >= len(data):
+				break
+
+			best_length = 0
+			best_distance = 0
+
+			for candidate in reversed(seen.get(data[offset:offset + 3], [])[-16:]):
+				if (offset - candidate) > 4096:
+					break
+
+				length = 0
+				limit = min(len(data) - offset, 18 + 255)
+
+				while (length < limit) and (data[candidate + length] == data[offset + length]):
+					length += 1
+
+				if length > best_length:
+					best_length = length
+					best_distance = offset - candidate
+
+			if best_length >= 3:
+				out[control] |= 1 << bit
+				match = (best_distance - 1) | ((min(best_length, 18) - 3) << 12)
+				out += bytes([match & 0xff, match >> 8])
+				if best_length >= 18:
+					out.append(best_length - 18)
+			else:
+				best_length = 1
+				out.append(data[offset])
+
+			for position in range(offset, offset + best_length):
+				if (position + 3) <= len(data):
+					seen.setdefault(data[position:position + 3], []).append(position)
+
+			offset += best_length
+
+	return bytes(out)
+
+def decapsulate(packet):
+	if (len(packet) >= header_2.size) and (packet[0] == packet_header_soh) and (struct.unpack_from("<H", packet, 2)[0] == packet_header_id):
+		if packet[1] == packet_header_version:
+			_, version, _, length, data_offset, data_pad_offset, oob_data_offset, _, flags, transaction_id, _, _, checksum = header_2.unpack_from(packet)
+		else:
+			_, version, _, flags, _, length, data_offset, data_pad_offset, oob_data_offset, transaction_id, checksum = header_3.unpack_from(packet)
+
+		if flags & (flag_md5_32_provided | flag_crc32c_provided):
+			unchecked = bytearray(packet[:length])
+			struct.pack_into("<I", unchecked, header_checksum_offset, 0)
+
+			if (crc32c(unchecked) if flags & flag_crc32c_provided else md5_32(unchecked)) != checksum:
+				counters["bad checksum"] += 1
+				return None
+
+		return { "raw": False, "version": version, "flags": flags, "transaction_id": transaction_id,
+				"data": packet[data_offset:data_pad_offset], "oob_data": packet[oob_data_offset:length] }
+
+	padding_offset = packet.find(b"\0")
+
+	if padding_offset < 0:
+		return { "raw": True, "data": packet, "oob_data": b"" }
+
+	oob_data_offset = (padding_offset + 4) & ~3
+
+	return { "raw": True, "data": packet[:padding_offset], "oob_data": packet[oob_data_offset:] }
+
+def encapsulate(request, data, oob_data, flags = 0):
+	if request["raw"]:
+		packet = data if data.endswith(b"\n") else data + b"\n"
+
+		if oob_data:
+			packet += b"\0" * (4 - (len(packet) % 4))
+			packet += oob_data
+
+		if args.raw_end:
+			packet += bytes([packet_raw_end]) + struct.pack("<I", len(packet))
+
+		return packet
+
+	if args.compress and (request["flags"] & flag_oob_compression_supported):
+		flags |= flag_oob_compression_supported
+
+		if oob_data:
+			compressed = compress(oob_data)
+
+			if len(compressed) < len(oob_data):
+				oob_data = compressed
+				flags |= flag_oob_compressed
+
+	if request["flags"] & flag_transaction_id_provided:
+		flags |= flag_transaction_id_provided
+		transaction_id = request["transaction_id"]
+	else:
+		transaction_id = 0
+
+	padding = b"\0" * ((4 - (len(data) % 4)) % 4) if oob_data else b""
+	body = data + padding + oob_data
+	data_pad_offset = header_2.size + len(data)
+	oob_data_offset = data_pad_offset + len(padding)
+	length = oob_data_offset + len(oob_data)
+
+	if (request["version"] == packet_header_version_3) or (args.multi and (request["flags"] & flag_version_3_supported)):
+		if request["flags"] & flag_crc32c_requested:
+			flags |= flag_crc32c_provided
+		elif request["flags"] & flag_md5_32_requested:
+			flags |= flag_md5_32_provided
+
+		header = lambda checksum: header_3.pack(packet_header_soh, packet_header_version_3, packet_header_id, flags, 0,
+				length, header_2.size, data_pad_offset, oob_data_offset, transaction_id, checksum)
+	else:
+		if request["flags"] & flag_md5_32_requested:
+			flags |= flag_md5_32_provided
+
+		header = lambda checksum: header_2.pack(packet_header_soh, packet_header_version, packet_header_id,
+				length, header_2.size, data_pad_offset, oob_data_offset, 0, flags, transaction_id, 0, 0, checksum)
+
+	if flags & flag_crc32c_provided:
+		checksum = crc32c(header(0) + body)
+	elif flags & flag_md5_32_provided:
+		checksum = md5_32(header(0) + body)
+	else:
+		checksum = 0
+
+	return header(checksum) + body
+
+# returns reply data and reply oob data, None for no reply at all (reset)
+
+def command(line, oob_data):
+	words = line.decode(errors = "replace").split()
+
+	if not words:
+		return b"", b""
+
+	name = words[0]
+	multi = args.multi
+
+	if name == "flash-info":
+		return ("OK flash function available, slots: 2, current: %d, sectors: [ 2, 258 ], display: 0x0px@0" % boot["current"]).encode(), b""
+
+	if name == "flash-read":
+		sector = int(words[1])
+		sectors = int(words[2]) if multi and (len(words) > 2) else 1
+		data = bytes(flash[sector * sector_size:(sector + sectors) * sector_size])
+
+		if multi and (len(words) > 2):
+			return ("OK flash-read: read sector %d, sectors %d" % (sector, sectors)).encode(), data
+
+		return ("OK flash-read: read sector %d" % sector).encode(), data
+
+	if name == "flash-write":
+		mode = int(words[1])
+		sector = int(words[2])
+		sectors = int(words[3]) if multi and (len(words) > 3) else 1
+		start = sector * sector_size
+		end = (sector + sectors) * sector_size
+		same = int(flash[start:end] == oob_data[:end - start])
+		erased = 0
+
+		if (mode == 1) and not same:
+			flash[start:end] = oob_data[:end - start].ljust(end - start, b"\xff")
+			erased = 1
+
+		if multi and (len(words) > 3):
+			return ("OK flash-write: written mode %d, sector %d, same %d, erased %d, sectors %d" % (mode, sector, same, erased, sectors)).encode(), b""
+
+		return ("OK flash-write: written mode %d, sector %d, same %d, erased %d" % (mode, sector, same, erased)).encode(), b""
+
+	if name == "flash-checksum":
+		sector = int(words[1])
+		sectors = int(words[2])
+		checksum = hashlib.sha1(flash[sector * sector_size:(sector + sectors) * sector_size]).hexdigest()
+		return ("OK flash-checksum: checksummed %d sectors from sector %d, checksum: %s" % (sectors, sector, checksum)).encode(), b""
+
+	if (name == "flash-checksum-list") and multi:
+		sector = int(words[1])
+		sectors = int(words[2])
+		checksums = b"".join(hashlib.sha1(flash[current * sector_size:(current + 1) * sector_size]).digest() for current in range(sector, sector + sectors))
+		return ("OK flash-checksum-list: checksummed %d sectors from sector %d" % (sectors, sector)).encode(), checksums
+
+	if name == "flash-bench":
+		length = int(words[1])
+		return ("OK flash-bench: sending %d bytes" % length).encode(), b"\0" * length
+
+	if name == "flash-select":
+		boot["selected"] = int(words[1])
+		return ("OK flash-select: slot %d selected, sector %d, permanent %s" % (boot["selected"], 2 if boot["selected"] == 0 else 258, words[2])).encode(), b""
+
+	if name == "reset":
+		boot["current"] = boot["selected"]
+		return None, None
+
+	if name == "stats":
+		return b"> firmware\n>  date: Jan  1 2000 00:00:00\n> uptime: 0 days 00:00:00\n", b""
+
+	return ("ERROR: unknown command: %s" % name).encode(), b""
+
+def process(packet):
+	if args.max_packet and (len(packet) > args.max_packet):
+		return None
+
+	request = decapsulate(packet)
+
+	if request is None:
+		return None
+
+	data = request["data"]
+	oob_data = request["oob_data"]
+
+	if (not request["raw"]) and args.compress and (request["flags"] & flag_oob_compressed) and oob_data:
+		try:
+			oob_data = decompress(oob_data)
+		except ValueError:
+			return None
+
+	# one record per command run, stop when the reply is full, see multi_command_reply_t in ota.h
+
+	if args.multi and (not request["raw"]) and (request["flags"] & flag_multi_command):
+		records = b""
+
+		for line in data.split(b"\n"):
+			reply_data, reply_oob_data = command(line, b"")
+
+			if reply_data is None:
+				break
+
+			record = multi_command_reply.pack(len(reply_data), len(reply_oob_data), 1 if reply_data.startswith(b"ERROR") else 0) + reply_data + reply_oob_data
+			record += b"\0" * ((4 - (len(record) % 4)) % 4)
+
+			if records and ((len(records) + len(record)) > multi_command_reply_max):
+				break
+
+			records += record
+
+		return encapsulate(request, b"", records, flag_multi_command)
+
+	reply_data, reply_oob_data = command(data, oob_data)
+
+	if reply_data is None:
+		return None
+
+	return encapsulate(request, reply_data, reply_oob_data)
+
+def lost():
+	if rng.random() >= args.loss:
+		return False
+
+	counters["lost"] += 1
+	return True
+
+def serve_udp():
+	udp_socket = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+	udp_socket.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 1 << 20)
+	udp_socket.bind(("127.0.0.1", args.port))
+
+	while True:
+		packet, address = udp_socket.recvfrom(65536)
+		counters["received"] += 1
+
+		if lost():
+			continue
+
+		reply = process(packet)
+
+		if reply is None:
+			continue
+
+		if args.delay:
+			time.sleep(args.delay)
+
+		if lost():
+			continue
+
+		udp_socket.sendto(reply, address)
+		counters["sent"] += 1
+
+# framed requests are cut by their header length, raw requests at the newline
+
+def serve_tcp_connection(connection):
+	stream = b""
+
+	while True:
+		received = connection.recv(65536)
+
+		if not received:
+			return
+
+		stream += received
+
+		while True:
+			if (len(stream) >= header_2.size) and (stream[0] == packet_header_soh) and (struct.unpack_from("<H", stream, 2)[0] == packet_header_id):
+				length = struct.unpack_from("<H", stream, 4)[0] if stream[1] == packet_header_version else struct.unpack_from("<I", stream, 8)[0]
+			else:
+				length = stream.find(b"\n") + 1
+
+			if (length <= 0) or (len(stream) < length):
+				break
+
+			packet = stream[:length]
+			stream = stream[length:]
+			reply = process(packet)
+
+			if reply is None:
+				connection.close()
+				return
+
+			connection.sendall(reply)
+
+def serve_tcp():
+	tcp_socket = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+	tcp_socket.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+	tcp_socket.bind(("127.0.0.1", args.port))
+	tcp_socket.listen(4)
+
+	while True:
+		connection, _ = tcp_socket.accept()
+		threading.Thread(target = serve_tcp_connection, args = (connection,), daemon = True).start()
+
+if args.tcp:
+	threading.Thread(target = serve_tcp, daemon = True).start()
+
+try:
+	serve_udp()
+except KeyboardInterrupt:
+	if args.verbose:
+		print(", ".join("%s: %d" % (key, value) for key, value in counters.items()), file = sys.stderr)
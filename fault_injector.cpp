@@ -0,0 +1,288 @@
+#include "fault_injector.h"
+#include "util.h"
+#include "exception.h"
+
+#include <string>
+#include <sstream>
+#include <boost/format.hpp>
+#include <boost/random/uniform_int_distribution.hpp>
+#include <boost/random/uniform_real_distribution.hpp>
+
+FaultInjector::FaultInjector(const std::string &specification)
+{
+	std::istringstream items(specification);
+	std::string item, key, value;
+	size_t equals;
+	unsigned int seed;
+
+	loss = 0;
+	duplicate = 0;
+	reorder = 0;
+	corrupt = 0;
+	delay_msec = 0;
+	jitter_msec = 0;
+	seed = 1;
+
+	while(std::getline(items, item, ','))
+	{
+		if(item.empty())
+			continue;
+
+		if((equals = item.find('=')) == std::string::npos)
+			throw(hard_exception(boost::format("fault injector: invalid item \"%s\"") % item));
+
+		key = item.substr(0, equals);
+		value = item.substr(equals + 1);
+
+		try
+		{
+			if(key == "loss")
+				loss = std::stod(value);
+			else
+				if(key == "duplicate")
+					duplicate = std::stod(value);
+				else
+					if(key == "reorder")
+						reorder = std::stod(value);
+					else
+						if(key == "corrupt")
+							corrupt = std::stod(value);
+						else
+							if(key == "delay")
+								delay_msec = std::stoul(value);
+							else
+								if(key == "jitter")
+									jitter_msec = std::stoul(value);
+								else
+									if(key == "seed")
+										seed = std::stoul(value);
+									else
+										throw(hard_exception(boost::format("fault injector: unknown fault \"%s\"") % key));
+		}
+		catch(const std::logic_error &)
+		{
+			throw(hard_exception(boost::format("fault injector: invalid value \"%s\"") % item));
+		}
+	}
+
+	if((loss < 0) || (loss > 1) || (duplicate < 0) || (duplicate > 1) || (reorder < 0) || (reorder > 1) || (corrupt < 0) || (corrupt > 1))
+		throw(hard_exception("fault injector: probability out of range"));
+
+	prn.seed(seed);
+}
+
+FaultInjector::~FaultInjector() noexcept
+{
+}
+
+bool FaultInjector::chance(double probability)
+{
+	boost::random::uniform_real_distribution<double> distribution(0, 1);
+
+	return((probability > 0) && (distribution(prn) < probability));
+}
+
+// flip one bit, anywhere in the datagram, header and checksum included
+
+void FaultInjector::corrupt_datagram(std::string &datagram)
+{
+	boost::random::uniform_int_distribution<unsigned int> bit(0, 7);
+
+	if(datagram.empty())
+		return;
+
+	boost::random::uniform_int_distribution<size_t> offset(0, datagram.length() - 1);
+
+	datagram[offset(prn)] ^= (char)(1 << bit(prn));
+	statistics.corrupted++;
+}
+
+// returns the datagrams to actually send, in order: none (lost, or held back to go after the next one),
+// one, or two (duplicated), possibly followed by a datagram held back before
+
+void FaultInjector::outgoing(const std::string &datagram, std::deque<std::string> &datagrams)
+{
+	std::string current;
+
+	datagrams.clear();
+	statistics.sent++;
+
+	if(chance(loss))
+	{
+		statistics.dropped++;
+		return;
+	}
+
+	current = datagram;
+
+	if(chance(corrupt))
+		corrupt_datagram(current);
+
+	if(held_outgoing.empty() && chance(reorder))
+	{
+		held_outgoing = current;
+		statistics.reordered++;
+		return;
+	}
+
+	datagrams.push_back(current);
+
+	if(chance(duplicate))
+	{
+		datagrams.push_back(current);
+		statistics.duplicated++;
+	}
+
+	if(!held_outgoing.empty())
+	{
+		datagrams.push_back(held_outgoing);
+		held_outgoing.clear();
+	}
+}
+
+// queue a received datagram, a reordered one is held until a later one has been delivered,
+// or until the receiver would time out otherwise
+
+void FaultInjector::incoming(const char *datagram, size_t length, const struct sockaddr_in *remote_host)
+{
+	boost::random::uniform_int_distribution<unsigned int> jitter(0, jitter_msec);
+	Pending entry;
+
+	statistics.received++;
+
+	if(chance(loss))
+	{
+		statistics.dropped++;
+		return;
+	}
+
+	entry.data.assign(datagram, length);
+	entry.release_usec = Util::time_usec();
+	entry.held = false;
+
+	if(remote_host)
+		entry.remote_host = *remote_host;
+	else
+		entry.remote_host = {};
+
+	if(chance(corrupt))
+		corrupt_datagram(entry.data);
+
+	if((delay_msec > 0) || (jitter_msec > 0))
+	{
+		entry.release_usec += (delay_msec + jitter(prn)) * 1000ULL;
+		statistics.delayed++;
+	}
+
+	if(chance(reorder))
+	{
+		entry.held = true;
+		statistics.reordered++;
+	}
+
+	pending.push_back(entry);
+
+	if(chance(duplicate))
+	{
+		entry.held = false;
+		pending.push_back(entry);
+		statistics.duplicated++;
+	}
+}
+
+// hand out the first datagram that's due, held datagrams in front of it become due right after it
+
+bool FaultInjector::deliver(char *buffer, size_t size, size_t &length, struct sockaddr_in *remote_host, bool timed_out)
+{
+	std::deque<Pending>::iterator it;
+	uint64_t now;
+
+	now = Util::time_usec();
+
+	for(it = pending.begin(); it != pending.end(); it++)
+		if(!it->held && (it->release_usec <= now))
+			break;
+
+	if(it == pending.end())
+	{
+		if(!timed_out)
+			return(false);
+
+		for(it = pending.begin(); it != pending.end(); it++)
+			if(it->held)
+				break;
+
+		if(it == pending.end())
+			return(false);
+	}
+	else
+		for(auto held = pending.begin(); held != it; held++)
+			held->held = false;
+
+	length = it->data.copy(buffer, size);
+
+	if(remote_host)
+		*remote_host = it->remote_host;
+
+	pending.erase(it);
+
+	return(true);
+}
+
+// the time to wait for the socket, at most timeout, less if a delayed datagram is due earlier
+
+int FaultInjector::next_release(int timeout) const noexcept
+{
+	uint64_t now;
+	int wait;
+
+	now = Util::time_usec();
+
+	for(const auto &entry : pending)
+	{
+		if(entry.held)
+			continue;
+
+		wait = (entry.release_usec > now) ? (int)((entry.release_usec - now + 999) / 1000) : 0;
+
+		if((timeout < 0) || (wait < timeout))
+			timeout = wait;
+	}
+
+	return(timeout);
+}
+
+// a datagram held back to go after the next one, when there is no next one (the receiver timed out)
+
+bool FaultInjector::release_outgoing(std::string &datagram)
+{
+	if(held_outgoing.empty())
+		return(false);
+
+	datagram.swap(held_outgoing);
+	held_outgoing.clear();
+
+	return(true);
+}
+
+// drop everything received but not delivered yet, like draining the socket does
+
+void FaultInjector::flush() noexcept
+{
+	pending.clear();
+}
+
+// a new connection, nothing of the old one is delivered or sent anymore
+
+void FaultInjector::clear() noexcept
+{
+	pending.clear();
+	held_outgoing.clear();
+}
+
+std::string FaultInjector::statistics_text() const
+{
+	return((boost::format("sent %u, received %u, dropped %u, duplicated %u, reordered %u, delayed %u, corrupted %u") %
+			statistics.sent % statistics.received % statistics.dropped % statistics.duplicated %
+			statistics.reordered % statistics.delayed % statistics.corrupted).str());
+}
@@ -0,0 +1,74 @@
+#ifndef _fault_injector_h_
+#define _fault_injector_h_
+
+#include <netinet/in.h>
+#include <string>
+#include <deque>
+#include <stdint.h>
+
+#include <boost/random/mersenne_twister.hpp>
+
+// network faults for udp unicast, to test the retry logic locally and measure goodput, see --faults and
+// --benchmark-faults, the specification is a comma separated list of:
+// loss=p, duplicate=p, reorder=p, corrupt=p (probability per datagram, each direction),
+// delay=ms, jitter=ms (added to each received datagram) and seed=n,
+// e.g. "loss=0.05,reorder=0.01,delay=10,jitter=5,seed=3"
+
+class FaultInjector
+{
+	friend class GenericSocket;
+	friend class Espif;
+
+	protected:
+
+		FaultInjector() = delete;
+		FaultInjector(const FaultInjector &) = delete;
+		FaultInjector(const std::string &specification);
+		~FaultInjector() noexcept;
+
+		struct Statistics
+		{
+			unsigned int sent = 0;
+			unsigned int received = 0;
+			unsigned int dropped = 0;
+			unsigned int duplicated = 0;
+			unsigned int reordered = 0;
+			unsigned int delayed = 0;
+			unsigned int corrupted = 0;
+		};
+
+		void outgoing(const std::string &datagram, std::deque<std::string> &datagrams);
+		void incoming(const char *datagram, size_t length, const struct sockaddr_in *remote_host);
+		bool deliver(char *buffer, size_t size, size_t &length, struct sockaddr_in *remote_host, bool timed_out);
+		int next_release(int timeout) const noexcept;
+		bool release_outgoing(std::string &datagram);
+		void flush() noexcept;
+		void clear() noexcept;
+		std::string statistics_text() const;
+
+		Statistics statistics;
+
+	private:
+
+		struct Pending
+		{
+			uint64_t release_usec;
+			bool held;
+			std::string data;
+			struct sockaddr_in remote_host;
+		};
+
+		double loss;
+		double duplicate;
+		double reorder;
+		double corrupt;
+		unsigned int delay_msec;
+		unsigned int jitter_msec;
+		boost::random::mt19937 prn;
+		std::string held_outgoing;
+		std::deque<Pending> pending;
+
+		bool chance(double probability);
+		void corrupt_datagram(std::string &datagram);
+};
+#endif
@@ -0,0 +1,235 @@
+#include "fleet.h"
+#include "exception.h"
+
+#include <string>
+#include <iostream>
+#include <boost/format.hpp>
+
+Fleet::Fleet(const EspifConfig &config_in, const std::vector<std::string> &host_names) : config(config_in)
+{
+	EspifConfig session_config;
+	size_t colon;
+
+	if(config.use_tcp || config.broadcast || config.multicast)
+		throw(hard_exception("fleet: only udp unicast is supported"));
+
+	// pacing sleeps, which would stall all other sessions, fleet commands are small anyway,
+	// the sockets are watched by epoll, so they can't use the io_uring backend
+
+	session_config = config;
+	session_config.pacing = false;
+	session_config.io_uring = false;
+
+	for(const auto &name : host_names)
+	{
+		hosts.emplace_back();
+		hosts.back().name = name;
+
+		// host or host:port
+
+		if((colon = name.find(':')) != std::string::npos)
+		{
+			session_config.host = name.substr(0, colon);
+			session_config.command_port = name.substr(colon + 1);
+		}
+		else
+		{
+			session_config.host = name;
+			session_config.command_port = config.command_port;
+		}
+
+		try
+		{
+			hosts.back().session = std::make_unique<Session>(loop, name, session_config, commands);
+		}
+		catch(const hard_exception &e)
+		{
+			hosts.back().error = e.what();
+		}
+	}
+}
+
+Fleet::~Fleet() noexcept
+{
+	hosts.clear();
+}
+
+std::string Fleet::send(std::string args)
+{
+	size_t current;
+	std::string output;
+	uint64_t start;
+	unsigned int ok, failed;
+
+	commands.clear();
+
+	while(args.length() > 0)
+	{
+		if((current = args.find('\n')) != std::string::npos)
+		{
+			commands.push_back(args.substr(0, current));
+			args.erase(0, current + 1);
+		}
+		else
+		{
+			commands.push_back(args);
+			args.clear();
+		}
+	}
+
+	start = Util::time_usec();
+
+	for(auto &host : hosts)
+		if(host.session)
+			host.session->start();
+
+	loop.run();
+
+	ok = failed = 0;
+
+	for(const auto &host : hosts)
+	{
+		if(host.session)
+		{
+			for(const auto &reply : host.session->replies)
+				output.append((boost::format("%s: %s\n") % host.name % reply).str());
+
+			if(host.session->error.empty())
+			{
+				ok++;
+				continue;
+			}
+
+			output.append((boost::format("%s: error: %s\n") % host.name % host.session->error).str());
+		}
+		else
+			output.append((boost::format("%s: error: %s\n") % host.name % host.error).str());
+
+		failed++;
+	}
+
+	if(config.verbose)
+		std::cout << boost::format("fleet: %u hosts, %u ok, %u failed, %u commands each, in %u ms") %
+				hosts.size() % ok % failed % commands.size() % ((Util::time_usec() - start) / 1000) << std::endl;
+
+	return(output);
+}
+
+Fleet::Session::Session(EventLoop &loop_in, const std::string &name_in, const EspifConfig &config_in, const std::vector<std::string> &commands_in)
+	:
+		loop(loop_in),
+		name(name_in),
+		config(config_in),
+		channel(config),
+		util(channel, config),
+		commands(commands_in)
+{
+	current = 0;
+	attempt = 0;
+	transaction_id = 0;
+	sent = 0;
+
+	loop.add(channel.socket_fd, this);
+}
+
+Fleet::Session::~Session() noexcept
+{
+	loop.cancel(this);
+	loop.remove(channel.socket_fd);
+}
+
+void Fleet::Session::start()
+{
+	current = 0;
+	replies.clear();
+	error.clear();
+
+	if(!commands.empty())
+		send_command();
+}
+
+void Fleet::Session::send_command()
+{
+	transaction_id = util.new_transaction_id();
+	util.codec.encapsulate(segments, commands[current], "", transaction_id);
+	attempt = 0;
+	transmit();
+}
+
+void Fleet::Session::transmit()
+{
+	struct iovec iov[Packet::segments_max];
+	unsigned int iov_count;
+
+	if(config.debug)
+		std::cout << std::endl << Util::dumper((name + ": data").c_str(), commands[current]) << std::endl;
+
+	// the socket is non-blocking, a failed send is just a lost packet, the timer will retransmit
+
+	iov_count = segments.gather(iov);
+	channel.send(iov, iov_count, 0);
+
+	sent = Util::time_usec();
+	loop.timer(this, sent + ((channel.rto() * 1000ULL) << attempt));
+}
+
+void Fleet::Session::readable()
+{
+	std::string_view message;
+	std::string_view reply_data;
+	std::string_view reply_oob_data;
+	bool raw;
+
+	while(channel.receive_message(message, 0))
+	{
+		if(!util.codec.decapsulate(receive_packet, message, reply_data, reply_oob_data, config.verbose, &raw))
+			continue;
+
+		if(current >= commands.size())
+			continue;
+
+		if(!raw && receive_packet.packet_header.flag.transaction_id_provided && (receive_packet.packet_header.transaction_id != transaction_id))
+		{
+			if(config.verbose)
+				std::cout << boost::format("%s: dropping stale reply, transaction id 0x%08x vs. 0x%08x") %
+						name % (unsigned int)receive_packet.packet_header.transaction_id % transaction_id << std::endl;
+			continue;
+		}
+
+		if(!raw)
+			util.negotiate_packet_version(receive_packet.packet_header.version);
+
+		if(attempt == 0)
+			channel.rtt_update(Util::time_usec() - sent);
+
+		replies.emplace_back(reply_data);
+
+		if(reply_oob_data.length() > 0)
+			replies.back().append((boost::format(" (%u bytes of OOB data)") % reply_oob_data.length()).str());
+
+		if(config.debug)
+			std::cout << std::endl << Util::dumper((name + ": reply").c_str(), replies.back()) << std::endl;
+
+		if(++current < commands.size())
+			send_command();
+		else
+			loop.cancel(this);
+	}
+}
+
+// the timeout doubles with every attempt, see transmit()
+
+void Fleet::Session::expired()
+{
+	if(++attempt >= max_attempts)
+	{
+		error = (boost::format("no reply to \"%s\" after %u attempts") % commands[current] % attempt).str();
+		current = commands.size();
+		return;
+	}
+
+	if(config.verbose)
+		std::cout << boost::format("%s: retransmit \"%s\", attempt #%u, %s") % name % commands[current] % attempt % channel.rtt_text() << std::endl;
+
+	transmit();
+}
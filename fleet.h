@@ -0,0 +1,79 @@
+#ifndef _fleet_h_
+#define _fleet_h_
+
+#include "espifconfig.h"
+#include "event_loop.h"
+#include "generic_socket.h"
+#include "util.h"
+#include "packet.h"
+
+#include <string>
+#include <vector>
+#include <memory>
+
+// send commands to many devices at once, one udp session per device, all driven from one thread by an event loop,
+// each session runs the commands in order, every command is a small state machine: sent -> (retransmit ->) reply or failed
+
+class Fleet
+{
+	public:
+
+		Fleet() = delete;
+		Fleet(const EspifConfig &config, const std::vector<std::string> &hosts);
+		~Fleet() noexcept;
+
+		std::string send(std::string args);
+
+	private:
+
+		class Session : public EventLoop::Handler
+		{
+			friend class Fleet;
+
+			public:
+
+				Session(EventLoop &loop, const std::string &name, const EspifConfig &config, const std::vector<std::string> &commands);
+				~Session() noexcept;
+
+			protected:
+
+				void readable() override;
+				void expired() override;
+
+			private:
+
+				enum { max_attempts = 4 };
+
+				EventLoop &loop;
+				const std::string name;
+				const EspifConfig config;
+				GenericSocket channel;
+				Util util;
+				const std::vector<std::string> &commands;
+				unsigned int current;
+				unsigned int attempt;
+				uint32_t transaction_id;
+				uint64_t sent;
+				Packet::Segments segments;
+				Packet receive_packet;
+				std::vector<std::string> replies;
+				std::string error;
+
+				void start();
+				void send_command();
+				void transmit();
+		};
+
+		struct Host
+		{
+			std::string name;
+			std::unique_ptr<Session> session;
+			std::string error;
+		};
+
+		const EspifConfig config;
+		EventLoop loop;
+		std::vector<std::string> commands;
+		std::vector<Host> hosts;
+};
+#endif
@@ -1,26 +1,89 @@
 #include "generic_socket.h"
+#include "io_uring_backend.h"
+#include "fault_injector.h"
 #include "util.h"
+#include "packet.h"
 #include "exception.h"
 
 #include <string>
+#include <deque>
 #include <string.h>
+#include <errno.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <poll.h>
+#include <sched.h>
 #include <iostream>
+#include <algorithm>
+#include <climits>
 
 GenericSocket::GenericSocket(const EspifConfig &config_in) : config(config_in)
 {
+	// the buffers are sized from this, see --transfer-sectors
+
+	transfer_sectors = std::clamp(config.transfer_sectors, 1U, (unsigned int)EspifConfig::transfer_sectors_max);
 	socket_fd = -1;
+	rtt_valid = false;
+	srtt_usec = 0;
+	rttvar_usec = 0;
+	rto_usec = rto_initial_usec;
+	pacing_slow_start = true;
+	pacing_rate = pacing_rate_initial;
+	pacing_tokens = pacing_burst_packets * (transfer_sectors + 1) * config.sector_size;
+	pacing_time_usec = Util::time_usec();
+	pacing_decrease_usec = 0;
+	stream_buffer.resize((transfer_sectors + 2) * config.sector_size);
+	stream_start = 0;
+	stream_end = 0;
+	stream_raw_end = false;
+	receive_buffer_pool = nullptr;
+	receive_buffer_count = (config.broadcast || config.multicast) ? receive_batch_max : receive_buffers;
+	receive_buffer_next = 0;
+	uring = nullptr;
+	faults = nullptr;
+
+	// faults are applied per datagram, see fault_injector.h
+
+	if(!config.faults.empty())
+	{
+		if(config.use_tcp || config.broadcast || config.multicast)
+			throw(hard_exception("fault injection: udp unicast only"));
+
+		faults = new FaultInjector(config.faults);
+	}
 
 	memset(&saddr, 0, sizeof(saddr));
 
+	// one datagram is at most a packet of transfer_sectors sectors plus command, reply and header
+
+	receive_buffer_size = (transfer_sectors + 1) * config.sector_size;
+	receive_buffer_size = (receive_buffer_size + receive_buffer_alignment - 1) & ~(size_t)(receive_buffer_alignment - 1);
+
+	if(posix_memalign((void **)&receive_buffer_pool, receive_buffer_alignment, receive_buffer_size * receive_buffer_count))
+		throw(hard_exception("receive buffer: out of memory"));
+
 	this->connect();
 }
 
 GenericSocket::~GenericSocket() noexcept
 {
 	this->disconnect();
+	delete faults;
+	free(receive_buffer_pool);
+}
+
+// the receive buffers are handed out round robin, so a message received into one
+// stays valid for the next receive_buffer_count - 1 receive calls,
+// broadcast and multicast sockets have receive_batch_max buffers, see receive_batch()
+
+char *GenericSocket::receive_buffer() noexcept
+{
+	char *buffer;
+
+	buffer = receive_buffer_pool + (receive_buffer_next * receive_buffer_size);
+	receive_buffer_next = (receive_buffer_next + 1) % receive_buffer_count;
+
+	return(buffer);
 }
 
 void GenericSocket::connect()
@@ -29,10 +92,12 @@ void GenericSocket::connect()
 	struct addrinfo *res = nullptr;
 	int socket_argument;
 
+	// all i/o is preceded by poll, so the sockets can be non-blocking, which the event loop requires
+
 	if(config.use_tcp)
 		socket_argument = SOCK_STREAM | SOCK_NONBLOCK;
 	else
-		socket_argument = SOCK_DGRAM;
+		socket_argument = SOCK_DGRAM | SOCK_NONBLOCK;
 
 	if((socket_fd = socket(AF_INET, socket_argument, 0)) < 0)
 		throw(hard_exception("socket failed"));
@@ -87,6 +152,39 @@ void GenericSocket::connect()
 			throw(hard_exception("multicast: cannot join mc group"));
 	}
 
+	if(config.broadcast || config.multicast)
+	{
+		int arg;
+		uint64_t size;
+		socklen_t length;
+
+		// all devices reply at once, make room for every reply to every probe in the socket queue,
+		// SO_RCVBUF is capped by net.core.rmem_max, SO_RCVBUFFORCE isn't, but needs CAP_NET_ADMIN
+
+		size = (uint64_t)std::max(config.multicast_hosts, (unsigned int)multicast_hosts_default) * std::max(config.multicast_burst, 1U) * multicast_reply_truesize;
+		arg = (int)std::min(size, (uint64_t)INT_MAX);
+
+		if(setsockopt(socket_fd, SOL_SOCKET, SO_RCVBUFFORCE, &arg, sizeof(arg)) &&
+				setsockopt(socket_fd, SOL_SOCKET, SO_RCVBUF, &arg, sizeof(arg)) &&
+				config.verbose)
+			std::cout << "multicast: cannot set receive buffer size" << std::endl;
+
+		length = sizeof(arg);
+
+		if(config.verbose && !getsockopt(socket_fd, SOL_SOCKET, SO_RCVBUF, &arg, &length))
+			std::cout << boost::format("multicast: receive buffer %d bytes") % arg << std::endl;
+	}
+
+	if(config.busy_poll_usec > 0)
+	{
+		int arg = config.busy_poll_usec;
+
+		// busy poll the device queue in the kernel too, raising it above net.core.busy_read needs CAP_NET_ADMIN
+
+		if(setsockopt(socket_fd, SOL_SOCKET, SO_BUSY_POLL, &arg, sizeof(arg)) && config.verbose)
+			std::cout << boost::format("busy poll: cannot set SO_BUSY_POLL: %s") % strerror(errno) << std::endl;
+	}
+
 	if(config.use_tcp)
 	{
 		struct pollfd pfd;
@@ -114,73 +212,267 @@ void GenericSocket::connect()
 			throw(hard_exception(config.host + ": " + e));
 		}
 	}
+
+	// the io_uring backend is bound to this socket, it's made again on every connect
+
+	if(config.io_uring)
+	{
+		try
+		{
+			uring = new IoUringBackend(socket_fd, !config.use_tcp, receive_buffer_size);
+		}
+		catch(const hard_exception &e)
+		{
+			if(config.verbose)
+				std::cout << boost::format("%s, using poll") % e.what() << std::endl;
+		}
+	}
 }
 
+// everything bound to the connection goes, a reconnect (after a reset) starts clean
+
 void GenericSocket::disconnect() noexcept
 {
+	delete uring;
+	uring = nullptr;
+
 	if(socket_fd >= 0)
 		close(socket_fd);
 
 	socket_fd = -1;
+	stream_start = 0;
+	stream_end = 0;
+	stream_raw_end = false;
+
+	if(faults)
+		faults->clear();
 }
 
-bool GenericSocket::send(std::string &data, int timeout) const
+bool GenericSocket::send(std::string &data, int timeout)
 {
-	struct pollfd pfd;
-	int length;
+	struct iovec iov = { .iov_base = data.data(), .iov_len = data.length() };
 
-	pfd.fd = socket_fd;
-	pfd.events = POLLOUT | POLLERR | POLLHUP;
-	pfd.revents = 0;
+	if(!send(&iov, 1, timeout))
+		return(false);
+
+	data.clear();
+
+	return(true);
+}
+
+bool GenericSocket::send(const struct iovec *iov, unsigned int iov_count, int timeout)
+{
+	std::deque<std::string> datagrams;
+	std::string datagram;
+	struct iovec datagram_iov;
+	unsigned int ix;
+
+	if(!faults)
+		return(transmit(iov, iov_count, timeout));
+
+	for(ix = 0; ix < iov_count; ix++)
+		datagram.append((const char *)iov[ix].iov_base, iov[ix].iov_len);
+
+	faults->outgoing(datagram, datagrams);
 
-	if(data.length() == 0)
+	for(auto &current : datagrams)
 	{
-		if(config.verbose)
-			std::cout << "send: empty buffer" << std::endl;
-		return(true);
+		datagram_iov = { .iov_base = current.data(), .iov_len = current.length() };
+
+		if(!transmit(&datagram_iov, 1, timeout))
+			return(false);
 	}
 
-	if(poll(&pfd, 1, timeout) != 1)
+	return(true);
+}
+
+bool GenericSocket::transmit(const struct iovec *iov_in, unsigned int iov_count, int timeout)
+{
+	struct pollfd pfd;
+	struct iovec iov[iov_max];
+	struct msghdr msg;
+	unsigned int ix, first;
+	size_t length;
+	ssize_t sent;
+
+	if(iov_count > iov_max)
+		throw(hard_exception("send: too many segments"));
+
+	length = 0;
+
+	for(ix = 0; ix < iov_count; ix++)
 	{
-		if(config.verbose)
-			std::cout << "send: timeout" << std::endl;
-		return(false);
+		iov[ix] = iov_in[ix];
+		length += iov[ix].iov_len;
 	}
 
-	if(pfd.revents & (POLLERR | POLLHUP))
+	if(length == 0)
 	{
 		if(config.verbose)
-			std::cout << "send: socket error" << std::endl;
-		return(false);
+			std::cout << "send: empty buffer" << std::endl;
+		return(true);
 	}
 
-	if(config.use_tcp)
-	{
-		if((length = ::send(socket_fd, data.data(), data.length(), 0)) <= 0)
-			return(false);
-	}
-	else
+	pace(length);
+
+	// udp sends the datagram in one go, tcp may need several calls
+
+	for(first = 0; first < iov_count;)
 	{
-		if((length = ::sendto(socket_fd, data.data(), data.length(), 0, (const struct sockaddr *)&this->saddr, sizeof(this->saddr))) <= 0)
-			return(false);
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov[first];
+		msg.msg_iovlen = iov_count - first;
+
+		if(!config.use_tcp)
+		{
+			msg.msg_name = &this->saddr;
+			msg.msg_namelen = sizeof(this->saddr);
+		}
+
+		if(uring)
+		{
+			if((sent = uring->send(&msg, timeout)) <= 0)
+			{
+				if(config.verbose)
+					std::cout << ((sent == 0) ? "send: timeout" : "send: socket error") << std::endl;
+				return(false);
+			}
+		}
+		else
+		{
+			pfd.fd = socket_fd;
+			pfd.events = POLLOUT | POLLERR | POLLHUP;
+			pfd.revents = 0;
+
+			if(poll(&pfd, 1, timeout) != 1)
+			{
+				if(config.verbose)
+					std::cout << "send: timeout" << std::endl;
+				return(false);
+			}
+
+			if(pfd.revents & (POLLERR | POLLHUP))
+			{
+				if(config.verbose)
+					std::cout << "send: socket error" << std::endl;
+				return(false);
+			}
+
+			if((sent = ::sendmsg(socket_fd, &msg, 0)) <= 0)
+				return(false);
+		}
+
+		if(!config.use_tcp)
+			break;
+
+		for(; (first < iov_count) && ((size_t)sent >= iov[first].iov_len); first++)
+			sent -= iov[first].iov_len;
+
+		if(first < iov_count)
+		{
+			iov[first].iov_base = (char *)iov[first].iov_base + sent;
+			iov[first].iov_len -= sent;
+		}
 	}
 
-	data.erase(0, length);
+	return(true);
+}
+
+bool GenericSocket::receive(std::string &data, int timeout, struct sockaddr_in *remote_host)
+{
+	char *buffer = receive_buffer();
+	size_t length;
+
+	if(!receive(buffer, receive_buffer_size, length, timeout, remote_host))
+		return(false);
+
+	data.append(buffer, length);
 
 	return(true);
 }
 
-bool GenericSocket::receive(std::string &data, int timeout, struct sockaddr_in *remote_host) const
+// receive into a caller supplied buffer, udp datagrams larger than the buffer are truncated,
+// with fault injection, datagrams go through the injector's queue first
+
+bool GenericSocket::receive(char *buffer, size_t size, size_t &length, int timeout, struct sockaddr_in *remote_host)
 {
-	int length;
-	char buffer[2 * config.sector_size];
+	struct sockaddr_in from;
+	std::string datagram;
+	struct iovec datagram_iov;
+	uint64_t deadline, now;
+	int wait;
+
+	if(!faults)
+		return(receive_datagram(buffer, size, length, timeout, remote_host));
+
+	deadline = Util::time_usec() + ((uint64_t)std::max(timeout, 0) * 1000ULL);
+
+	for(;;)
+	{
+		if(faults->deliver(buffer, size, length, remote_host, false))
+			return(true);
+
+		now = Util::time_usec();
+		wait = faults->next_release((deadline > now) ? (int)((deadline - now + 999) / 1000) : 0);
+
+		if(receive_datagram(buffer, size, length, wait, &from))
+		{
+			faults->incoming(buffer, length, &from);
+			continue;
+		}
+
+		if(Util::time_usec() >= deadline)
+		{
+			// nothing was sent after a datagram held back for reorder, send it late instead of losing it
+
+			if((timeout > 0) && faults->release_outgoing(datagram))
+			{
+				datagram_iov = { .iov_base = datagram.data(), .iov_len = datagram.length() };
+				transmit(&datagram_iov, 1, timeout);
+			}
+
+			return(faults->deliver(buffer, size, length, remote_host, true));
+		}
+	}
+}
+
+bool GenericSocket::receive_datagram(char *buffer, size_t size, size_t &length, int timeout, struct sockaddr_in *remote_host)
+{
+	ssize_t rv;
 	socklen_t remote_host_length = sizeof(*remote_host);
 	struct pollfd pfd = { .fd = socket_fd, .events = POLLIN | POLLERR | POLLHUP, .revents = 0 };
+	std::string_view data;
+
+	length = 0;
+
+	if(uring)
+	{
+		if((rv = uring->receive(data, timeout, remote_host)) <= 0)
+		{
+			if(config.verbose && ((rv < 0) || (timeout > 0)))
+				std::cout << ((rv == 0) ? "receive: timeout" : "receive: socket error") << std::endl;
+			return(false);
+		}
+
+		length = data.copy(buffer, size);
+		uring->release();
+		pacing_charge(length);
+
+		return(true);
+	}
+
+	if((timeout > 0) && ((rv = receive_spin(buffer, size, remote_host)) > 0))
+	{
+		length = (size_t)rv;
+		pacing_charge(length);
+
+		return(true);
+	}
 
 	if(poll(&pfd, 1, timeout) != 1)
 	{
-		if(config.verbose)
-			std::cout << boost::format("receive: timeout, length: %u") % data.length() << std::endl;
+		if(config.verbose && (timeout > 0))
+			std::cout << "receive: timeout" << std::endl;
 		return(false);
 	}
 
@@ -200,7 +492,7 @@ bool GenericSocket::receive(std::string &data, int timeout, struct sockaddr_in *
 
 	if(config.use_tcp)
 	{
-		if((length = ::recv(socket_fd, buffer, sizeof(buffer) - 1, 0)) <= 0)
+		if((rv = ::recv(socket_fd, buffer, size, 0)) <= 0)
 		{
 			if(config.verbose)
 				std::cout << std::endl << "tcp receive: length <= 0" << std::endl;
@@ -209,7 +501,7 @@ bool GenericSocket::receive(std::string &data, int timeout, struct sockaddr_in *
 	}
 	else
 	{
-		if((length = ::recvfrom(socket_fd, buffer, sizeof(buffer) - 1, 0, (sockaddr *)remote_host, &remote_host_length)) <= 0)
+		if((rv = ::recvfrom(socket_fd, buffer, size, 0, (sockaddr *)remote_host, &remote_host_length)) <= 0)
 		{
 			if(config.verbose)
 				std::cout << std::endl << "udp receive: length <= 0" << std::endl;
@@ -217,16 +509,282 @@ bool GenericSocket::receive(std::string &data, int timeout, struct sockaddr_in *
 		}
 	}
 
-	data.append(buffer, (size_t)length);
+	length = (size_t)rv;
+	pacing_charge(length);
 
 	return(true);
 }
 
-void GenericSocket::drain(int timeout) const noexcept
+// udp only, wait for at most timeout ms for the first datagram, then take everything that's already queued,
+// up to receive_batch_max datagrams in one system call, the messages are views into the receive buffers,
+// valid until the next receive call of any kind
+
+unsigned int GenericSocket::receive_batch(std::vector<std::string_view> &messages, std::vector<struct sockaddr_in> &remote_hosts, int timeout)
+{
+	struct mmsghdr msgs[receive_batch_max];
+	struct iovec iov[receive_batch_max];
+	struct sockaddr_in remote_host;
+	struct pollfd pfd;
+	unsigned int ix, count;
+	size_t length;
+	char *buffer;
+	int rv;
+
+	messages.clear();
+	remote_hosts.clear();
+	count = std::min(receive_buffer_count, (unsigned int)receive_batch_max);
+
+	if(uring)
+	{
+		for(ix = 0; ix < count; ix++)
+		{
+			buffer = receive_buffer();
+
+			if(!receive(buffer, receive_buffer_size, length, (ix == 0) ? timeout : 0, &remote_host))
+				break;
+
+			messages.emplace_back(buffer, length);
+			remote_hosts.push_back(remote_host);
+		}
+
+		return(messages.size());
+	}
+
+	pfd.fd = socket_fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	if(poll(&pfd, 1, timeout) != 1)
+		return(0);
+
+	memset(msgs, 0, sizeof(msgs));
+	remote_hosts.resize(count);
+
+	for(ix = 0; ix < count; ix++)
+	{
+		iov[ix].iov_base = receive_buffer_pool + (ix * receive_buffer_size);
+		iov[ix].iov_len = receive_buffer_size;
+		msgs[ix].msg_hdr.msg_iov = &iov[ix];
+		msgs[ix].msg_hdr.msg_iovlen = 1;
+		msgs[ix].msg_hdr.msg_name = &remote_hosts[ix];
+		msgs[ix].msg_hdr.msg_namelen = sizeof(remote_hosts[ix]);
+	}
+
+	if((rv = ::recvmmsg(socket_fd, msgs, count, MSG_DONTWAIT, nullptr)) <= 0)
+	{
+		remote_hosts.clear();
+
+		if((rv < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && config.verbose)
+			std::cout << boost::format("receive batch: %s") % strerror(errno) << std::endl;
+
+		return(0);
+	}
+
+	remote_hosts.resize(rv);
+
+	for(ix = 0; ix < (unsigned int)rv; ix++)
+		messages.emplace_back((const char *)iov[ix].iov_base, msgs[ix].msg_len);
+
+	return(rv);
+}
+
+// udp: one datagram is one message
+// tcp: cut exactly one message from the byte stream, see Packet::stream_length,
+// anything after it (pipelined replies) stays buffered for the next call
+// the message is not copied, it's a view into the socket's buffers, valid until the next receive_message call
+
+bool GenericSocket::receive_message(std::string_view &message, int timeout)
+{
+	char *buffer;
+	size_t length;
+	bool quiet, framed;
+	int rv;
+
+	if(!config.use_tcp && uring && !faults)
+	{
+		if((rv = uring->receive(message, timeout)) <= 0)
+		{
+			if(config.verbose && ((rv < 0) || (timeout > 0)))
+				std::cout << ((rv == 0) ? "receive: timeout" : "receive: socket error") << std::endl;
+			return(false);
+		}
+
+		pacing_charge(message.length());
+
+		return(true);
+	}
+
+	if(!config.use_tcp)
+	{
+		buffer = receive_buffer();
+
+		if(!receive(buffer, receive_buffer_size, length, timeout))
+			return(false);
+
+		message = std::string_view(buffer, length);
+
+		return(true);
+	}
+
+	quiet = false;
+
+	for(;;)
+	{
+		length = Packet::stream_length(std::string_view(stream_buffer.data() + stream_start, stream_end - stream_start), quiet, framed);
+
+		if(length > 0)
+		{
+			// a raw message cut before the stream went quiet had an end marker,
+			// from now on the firmware is known to send them, don't cut on quiet anymore
+
+			if(!framed && !quiet)
+				stream_raw_end = true;
+
+			message = std::string_view(stream_buffer.data() + stream_start, length);
+			stream_start += length;
+
+			return(true);
+		}
+
+		if(quiet)
+			return(false);
+
+		// a raw message without end marker is complete when no more data arrives for a while
+
+		if(!framed && !stream_raw_end && (stream_end > stream_start))
+			rv = stream_fill(std::min(timeout, (int)stream_quiet_msec));
+		else
+			rv = stream_fill(timeout);
+
+		if(rv < 0)
+			return(false);
+
+		if(rv == 0)
+		{
+			if(framed || stream_raw_end || (stream_end == stream_start))
+			{
+				if(config.verbose)
+					std::cout << boost::format("receive: timeout, buffered: %u") % (stream_end - stream_start) << std::endl;
+
+				return(false);
+			}
+
+			quiet = true;
+		}
+	}
+}
+
+int GenericSocket::stream_fill(int timeout)
+{
+	struct pollfd pfd = { .fd = socket_fd, .events = POLLIN | POLLERR | POLLHUP, .revents = 0 };
+	ssize_t length;
+	std::string_view data;
+	int rv;
+
+	if(stream_start > 0)
+	{
+		memmove(stream_buffer.data(), stream_buffer.data() + stream_start, stream_end - stream_start);
+		stream_end -= stream_start;
+		stream_start = 0;
+	}
+
+	if(stream_end == stream_buffer.size())
+		stream_buffer.resize(stream_buffer.size() * 2);
+
+	if(uring)
+	{
+		if((rv = uring->receive(data, timeout)) <= 0)
+		{
+			if(config.verbose && (rv < 0))
+				std::cout << std::endl << "tcp receive: socket error" << std::endl;
+			return(rv);
+		}
+
+		while((stream_buffer.size() - stream_end) < data.length())
+			stream_buffer.resize(stream_buffer.size() * 2);
+
+		data.copy(stream_buffer.data() + stream_end, data.length());
+		uring->release();
+		stream_end += data.length();
+		pacing_charge(data.length());
+
+		return(1);
+	}
+
+	if((timeout > 0) && ((length = receive_spin(stream_buffer.data() + stream_end, stream_buffer.size() - stream_end, nullptr)) > 0))
+	{
+		stream_end += length;
+		pacing_charge(length);
+
+		return(1);
+	}
+
+	if(poll(&pfd, 1, timeout) != 1)
+		return(0);
+
+	if(pfd.revents & (POLLERR | POLLHUP))
+	{
+		if(config.verbose)
+			std::cout << std::endl << "receive: socket error" << std::endl;
+		return(-1);
+	}
+
+	if((length = ::recv(socket_fd, stream_buffer.data() + stream_end, stream_buffer.size() - stream_end, 0)) <= 0)
+	{
+		if(config.verbose)
+			std::cout << std::endl << "tcp receive: length <= 0" << std::endl;
+		return(-1);
+	}
+
+	stream_end += length;
+	pacing_charge(length);
+
+	return(1);
+}
+
+// low latency mode (--busy-poll): before sleeping in poll(), which costs a wakeup when the reply arrives,
+// keep trying a non-blocking receive for up to busy_poll_usec, returns the length received
+// or 0 if nothing arrived in time, leaving errors and end of stream to the poll() that follows
+
+ssize_t GenericSocket::receive_spin(char *buffer, size_t size, struct sockaddr_in *remote_host) noexcept
+{
+	socklen_t remote_host_length = sizeof(*remote_host);
+	uint64_t spin_end;
+	ssize_t rv;
+
+	if(config.busy_poll_usec == 0)
+		return(0);
+
+	spin_end = Util::time_usec() + config.busy_poll_usec;
+
+	do
+	{
+		if(config.use_tcp)
+			rv = ::recv(socket_fd, buffer, size, MSG_DONTWAIT);
+		else
+			rv = ::recvfrom(socket_fd, buffer, size, MSG_DONTWAIT, (sockaddr *)remote_host, remote_host ? &remote_host_length : nullptr);
+
+		if(rv > 0)
+			return(rv);
+
+		if((rv == 0) || (errno != EAGAIN))
+			return(0);
+
+		// don't starve the process that's going to send the reply, when it's on the same cpu
+
+		sched_yield();
+	}
+	while(Util::time_usec() < spin_end);
+
+	return(0);
+}
+
+void GenericSocket::drain(int timeout) noexcept
 {
 	struct pollfd pfd;
-	enum { drain_packets_buffer_size = 4, drain_packets = 16 };
-	char *buffer = (char *)alloca(config.sector_size * drain_packets_buffer_size);
+	enum { drain_packets = 16 };
+	char *buffer = receive_buffer();
+	std::string_view data;
 	int length;
 	int bytes = 0;
 	int packet = 0;
@@ -234,8 +792,47 @@ void GenericSocket::drain(int timeout) const noexcept
 	if(config.verbose)
 		std::cout << boost::format("draining %u...") % timeout << std::endl;
 
+	stream_start = stream_end = 0;
+
+	// a request held back by the fault injector goes out now, its reply is drained with the rest,
+	// injected datagrams still queued are as stale as the ones in the socket
+
+	if(faults)
+	{
+		std::string datagram;
+		struct iovec datagram_iov;
+
+		if(faults->release_outgoing(datagram))
+		{
+			datagram_iov = { .iov_base = datagram.data(), .iov_len = datagram.length() };
+			transmit(&datagram_iov, 1, timeout);
+		}
+
+		faults->flush();
+	}
+
 	for(packet = 0; packet < drain_packets; packet++)
 	{
+		if(uring)
+		{
+			try
+			{
+				if(uring->receive(data, timeout) <= 0)
+					break;
+			}
+			catch(const hard_exception &)
+			{
+				break;
+			}
+
+			if(config.verbose)
+				std::cout << Util::dumper("drain", std::string(data)) << std::endl;
+
+			bytes += data.length();
+			uring->release();
+			continue;
+		}
+
 		pfd.fd = socket_fd;
 		pfd.events = POLLIN | POLLERR | POLLHUP;
 		pfd.revents = 0;
@@ -248,12 +845,12 @@ void GenericSocket::drain(int timeout) const noexcept
 
 		if(config.use_tcp)
 		{
-			if((length = ::recv(socket_fd, buffer, config.sector_size * drain_packets_buffer_size, 0)) < 0)
+			if((length = ::recv(socket_fd, buffer, receive_buffer_size, 0)) < 0)
 				break;
 		}
 		else
 		{
-			if((length = ::recvfrom(socket_fd, buffer, config.sector_size * drain_packets_buffer_size, 0, (struct sockaddr *)0, 0)) < 0)
+			if((length = ::recvfrom(socket_fd, buffer, receive_buffer_size, 0, (struct sockaddr *)0, 0)) < 0)
 				break;
 		}
 
@@ -266,3 +863,128 @@ void GenericSocket::drain(int timeout) const noexcept
 	if(config.verbose && (packet > 0))
 		std::cout << boost::format("drained %u bytes in %u packets") % bytes % packet << std::endl;
 }
+
+int GenericSocket::rto() const noexcept
+{
+	return((rto_usec + 999) / 1000);
+}
+
+void GenericSocket::rtt_update(uint64_t rtt_usec) noexcept
+{
+	uint64_t deviation;
+
+	// smoothed rtt and rtt variance as in RFC 6298, alpha = 1/8, beta = 1/4
+
+	if(!rtt_valid)
+	{
+		srtt_usec = rtt_usec;
+		rttvar_usec = rtt_usec / 2;
+		rtt_valid = true;
+	}
+	else
+	{
+		deviation = (srtt_usec > rtt_usec) ? (srtt_usec - rtt_usec) : (rtt_usec - srtt_usec);
+		rttvar_usec = ((3 * rttvar_usec) + deviation) / 4;
+		srtt_usec = ((7 * srtt_usec) + rtt_usec) / 8;
+	}
+
+	rto_usec = srtt_usec + std::max(rttvar_usec * 4, (uint64_t)1000);
+
+	if(rto_usec < rto_min_usec)
+		rto_usec = rto_min_usec;
+
+	if(rto_usec > rto_max_usec)
+		rto_usec = rto_max_usec;
+}
+
+void GenericSocket::rto_backoff() noexcept
+{
+	rto_usec *= 2;
+
+	if(rto_usec > rto_max_usec)
+		rto_usec = rto_max_usec;
+}
+
+std::string GenericSocket::rtt_text() const
+{
+	return((boost::format("srtt %.1f ms, rttvar %.1f ms, rto %u ms") % (srtt_usec / 1000.0) % (rttvar_usec / 1000.0) % rto()).str());
+}
+
+void GenericSocket::pace(unsigned int length) noexcept
+{
+	uint64_t now;
+	double burst;
+
+	// token bucket: tokens are bytes, refilled at the current pacing rate, up to a few packets of burst
+
+	if(!config.pacing || config.broadcast || config.multicast)
+		return;
+
+	burst = pacing_burst_packets * (transfer_sectors + 1) * config.sector_size;
+	now = Util::time_usec();
+	pacing_tokens += pacing_rate * (now - pacing_time_usec) / 1000000.0;
+	pacing_time_usec = now;
+
+	if(pacing_tokens > burst)
+		pacing_tokens = burst;
+
+	if(pacing_tokens < length)
+	{
+		usleep((useconds_t)(((length - pacing_tokens) * 1000000.0) / pacing_rate));
+		pacing_tokens = length;
+		pacing_time_usec = Util::time_usec();
+	}
+
+	pacing_tokens -= length;
+}
+
+void GenericSocket::pacing_charge(unsigned int length) noexcept
+{
+	if(!config.pacing || config.broadcast || config.multicast)
+		return;
+
+	pacing_tokens -= length;
+}
+
+void GenericSocket::pacing_success() noexcept
+{
+	// additive increase, or doubling while no loss has been seen yet (slow start)
+
+	if(pacing_slow_start)
+		pacing_rate *= 2;
+	else
+		pacing_rate += pacing_increase;
+
+	if(pacing_rate > pacing_rate_max)
+		pacing_rate = pacing_rate_max;
+}
+
+void GenericSocket::pacing_loss() noexcept
+{
+	uint64_t now;
+
+	// multiplicative decrease, at most once per rto, so a burst of losses counts only once
+
+	now = Util::time_usec();
+
+	if((now - pacing_decrease_usec) < rto_usec)
+		return;
+
+	pacing_decrease_usec = now;
+	pacing_slow_start = false;
+	pacing_rate /= 2;
+
+	if(pacing_rate < pacing_rate_min)
+		pacing_rate = pacing_rate_min;
+
+	if(config.verbose && config.pacing)
+		std::cout << boost::format("pacing: loss, rate reduced to %.0f kbytes/s") % (pacing_rate / 1024) << std::endl;
+}
+
+std::string GenericSocket::pacing_text() const
+{
+	if(!config.pacing)
+		return("pacing off");
+
+	return((boost::format("pacing %.0f kbytes/s") % (pacing_rate / 1024)).str());
+}
@@ -4,28 +4,94 @@
 #include "espifconfig.h"
 
 #include <netinet/in.h>
+#include <sys/uio.h>
 #include <string>
+#include <string_view>
+#include <vector>
+#include <stdint.h>
+
+class IoUringBackend;
+class FaultInjector;
 
 class GenericSocket
 {
 	friend class Espif;
 	friend class Util;
+	friend class Fleet;
 
 	protected:
 
 		GenericSocket(const EspifConfig &);
 		~GenericSocket() noexcept;
 
-		bool send(std::string &data, int timeout = 500) const;
-		bool receive(std::string &data, int timeout = 500, struct sockaddr_in *remote_host = nullptr) const;
-		void drain(int timeout = 500) const noexcept;
+		bool send(std::string &data, int timeout = 500);
+		bool send(const struct iovec *iov, unsigned int iov_count, int timeout = 500);
+		bool receive(std::string &data, int timeout = 500, struct sockaddr_in *remote_host = nullptr);
+		bool receive(char *buffer, size_t size, size_t &length, int timeout = 500, struct sockaddr_in *remote_host = nullptr);
+		bool receive_message(std::string_view &message, int timeout = 500);
+		unsigned int receive_batch(std::vector<std::string_view> &messages, std::vector<struct sockaddr_in> &remote_hosts, int timeout = 500);
+		void drain(int timeout = 500) noexcept;
 		void connect();
 		void disconnect() noexcept;
+		int rto() const noexcept;
+		void rtt_update(uint64_t rtt_usec) noexcept;
+		void rto_backoff() noexcept;
+		std::string rtt_text() const;
+		void pace(unsigned int length) noexcept;
+		void pacing_charge(unsigned int length) noexcept;
+		void pacing_success() noexcept;
+		void pacing_loss() noexcept;
+		std::string pacing_text() const;
 
 	private:
 
+		enum
+		{
+			rto_initial_usec = 500000,
+			rto_min_usec = 20000,
+			rto_max_usec = 10000000,
+			pacing_rate_initial = 128 * 1024,
+			pacing_rate_min = 8 * 1024,
+			pacing_rate_max = 64 * 1024 * 1024,
+			pacing_increase = 32 * 1024,
+			pacing_burst_packets = 4,
+			iov_max = 8,
+			stream_quiet_msec = 20,
+			receive_buffers = 4,
+			receive_buffer_alignment = 64,
+			receive_batch_max = 32,
+			multicast_hosts_default = 256,
+			multicast_reply_truesize = 2048,
+		};
+
 		int socket_fd;
 		struct sockaddr_in saddr;
+		unsigned int transfer_sectors;
+		bool rtt_valid;
+		uint64_t srtt_usec;
+		uint64_t rttvar_usec;
+		uint64_t rto_usec;
+		bool pacing_slow_start;
+		double pacing_rate;
+		double pacing_tokens;
+		uint64_t pacing_time_usec;
+		uint64_t pacing_decrease_usec;
+		std::vector<char> stream_buffer;
+		size_t stream_start;
+		size_t stream_end;
+		bool stream_raw_end;
+		IoUringBackend *uring;
+		FaultInjector *faults;
+		char *receive_buffer_pool;
+		size_t receive_buffer_size;
+		unsigned int receive_buffer_count;
+		unsigned int receive_buffer_next;
+
+		bool transmit(const struct iovec *iov, unsigned int iov_count, int timeout);
+		bool receive_datagram(char *buffer, size_t size, size_t &length, int timeout, struct sockaddr_in *remote_host);
+		int stream_fill(int timeout);
+		ssize_t receive_spin(char *buffer, size_t size, struct sockaddr_in *remote_host) noexcept;
+		char *receive_buffer() noexcept;
 
 		const EspifConfig config;
 };
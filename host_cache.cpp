@@ -0,0 +1,111 @@
+#include "host_cache.h"
+
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <boost/format.hpp>
+
+HostCache::HostCache(const std::string &name)
+{
+	const char *home;
+
+	dirty = false;
+
+	if((home = getenv("HOME")))
+		filename = (boost::format("%s/.espif-%s") % home % name).str();
+
+	load();
+}
+
+HostCache::~HostCache() noexcept
+{
+}
+
+// expired entries are skipped
+
+void HostCache::load() noexcept
+{
+	std::ifstream file;
+	std::string line;
+	std::string key, value;
+	long long expires;
+	time_t now;
+
+	if(filename.empty())
+		return;
+
+	file.open(filename);
+
+	if(!file.is_open())
+		return;
+
+	now = time(nullptr);
+
+	while(std::getline(file, line))
+	{
+		std::istringstream fields(line);
+
+		if(!(fields >> key >> expires >> value))
+			continue;
+
+		if(expires > now)
+			entries[key] = { value, (time_t)expires };
+	}
+}
+
+void HostCache::save() noexcept
+{
+	std::ofstream file;
+	std::string tmpname;
+	time_t now;
+
+	if(!dirty || filename.empty())
+		return;
+
+	tmpname = filename + ".tmp";
+	now = time(nullptr);
+
+	try
+	{
+		file.open(tmpname, std::ios::out | std::ios::trunc);
+
+		if(!file.is_open())
+			return;
+
+		for(const auto &entry : entries)
+			if(entry.second.expires > now)
+				file << boost::format("%s %lld %s\n") % entry.first % (long long)entry.second.expires % entry.second.value;
+
+		file.close();
+
+		if(file.fail() || rename(tmpname.c_str(), filename.c_str()))
+			unlink(tmpname.c_str());
+		else
+			dirty = false;
+	}
+	catch(...)
+	{
+		unlink(tmpname.c_str());
+	}
+}
+
+bool HostCache::lookup(const std::string &key, std::string &value) const
+{
+	auto it = entries.find(key);
+
+	if((it == entries.end()) || (it->second.expires <= time(nullptr)))
+		return(false);
+
+	value = it->second.value;
+
+	return(true);
+}
+
+void HostCache::store(const std::string &key, const std::string &value, unsigned int ttl_seconds)
+{
+	entries[key] = { value, time(nullptr) + ttl_seconds };
+	dirty = true;
+}
@@ -0,0 +1,38 @@
+#ifndef _host_cache_h_
+#define _host_cache_h_
+
+#include <string>
+#include <map>
+#include <time.h>
+
+// small persistent key/value store with a ttl per entry, in ~/.espif-<name>,
+// one line per entry: "<key> <expiry, unix time> <value>", keys and values can't contain white space
+
+class HostCache
+{
+	public:
+
+		HostCache() = delete;
+		HostCache(const HostCache &) = delete;
+		HostCache(const std::string &name);
+		~HostCache() noexcept;
+
+		bool lookup(const std::string &key, std::string &value) const;
+		void store(const std::string &key, const std::string &value, unsigned int ttl_seconds);
+		void save() noexcept;
+
+	private:
+
+		struct Entry
+		{
+			std::string value;
+			time_t expires;
+		};
+
+		std::string filename;
+		std::map<std::string, Entry> entries;
+		bool dirty;
+
+		void load() noexcept;
+};
+#endif
@@ -0,0 +1,473 @@
+#include "io_uring_backend.h"
+#include "util.h"
+#include "exception.h"
+
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *params)
+{
+	return(syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags, const void *arg, size_t arg_size)
+{
+	return(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size));
+}
+
+static int io_uring_register(int fd, unsigned int opcode, const void *arg, unsigned int nr_args)
+{
+	return(syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+IoUringBackend::IoUringBackend(int socket_fd_in, bool datagram_in, unsigned int payload_size)
+	:
+		socket_fd(socket_fd_in), datagram(datagram_in)
+{
+	struct io_uring_params params;
+	struct io_uring_buf_reg buffer_reg;
+	unsigned int ix;
+
+	ring_fd = -1;
+	buffer_pool = nullptr;
+	buffer_ring = nullptr;
+	buffer_ring_tail = 0;
+	held_buffer = -1;
+	sq_ring = cq_ring = MAP_FAILED;
+	sqes = (struct io_uring_sqe *)MAP_FAILED;
+	to_submit = 0;
+	receive_armed = false;
+	send_done = false;
+	send_result = 0;
+
+	// a recvmsg buffer starts with a header and the source address, the payload follows
+
+	buffer_size = payload_size;
+
+	if(datagram)
+		buffer_size += sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_in);
+
+	buffer_size = (buffer_size + 63) & ~63U;
+
+	memset(&receive_msg, 0, sizeof(receive_msg));
+	receive_msg.msg_namelen = sizeof(struct sockaddr_in);
+
+	try
+	{
+		memset(&params, 0, sizeof(params));
+
+		if((ring_fd = io_uring_setup(ring_entries, &params)) < 0)
+			throw(hard_exception(boost::format("io_uring: setup failed: %s") % strerror(errno)));
+
+		if(!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_SINGLE_MMAP))
+			throw(hard_exception("io_uring: kernel too old"));
+
+		sq_ring_size = params.sq_off.array + (params.sq_entries * sizeof(unsigned int));
+		cq_ring_size = params.cq_off.cqes + (params.cq_entries * sizeof(struct io_uring_cqe));
+
+		if(cq_ring_size > sq_ring_size)
+			sq_ring_size = cq_ring_size;
+
+		cq_ring_size = sq_ring_size;
+
+		if((sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING)) == MAP_FAILED)
+			throw(hard_exception("io_uring: cannot map rings"));
+
+		cq_ring = sq_ring;
+		sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+		if((sqes = (struct io_uring_sqe *)mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES)) == MAP_FAILED)
+			throw(hard_exception("io_uring: cannot map submission queue entries"));
+
+		sq_head = (unsigned int *)((char *)sq_ring + params.sq_off.head);
+		sq_tail = (unsigned int *)((char *)sq_ring + params.sq_off.tail);
+		sq_mask = (unsigned int *)((char *)sq_ring + params.sq_off.ring_mask);
+		sq_array = (unsigned int *)((char *)sq_ring + params.sq_off.array);
+		cq_head = (unsigned int *)((char *)cq_ring + params.cq_off.head);
+		cq_tail = (unsigned int *)((char *)cq_ring + params.cq_off.tail);
+		cq_mask = (unsigned int *)((char *)cq_ring + params.cq_off.ring_mask);
+		cqes = (struct io_uring_cqe *)((char *)cq_ring + params.cq_off.cqes);
+
+		// provided buffer ring, the kernel picks a buffer for every datagram that arrives
+
+		if(posix_memalign((void **)&buffer_pool, 4096, buffer_size * buffers) ||
+				posix_memalign((void **)&buffer_ring, 4096, buffers * sizeof(struct io_uring_buf)))
+			throw(hard_exception("io_uring: out of memory"));
+
+		memset(buffer_ring, 0, buffers * sizeof(struct io_uring_buf));
+		memset(&buffer_reg, 0, sizeof(buffer_reg));
+		buffer_reg.ring_addr = (uint64_t)buffer_ring;
+		buffer_reg.ring_entries = buffers;
+		buffer_reg.bgid = buffer_group;
+
+		if(io_uring_register(ring_fd, IORING_REGISTER_PBUF_RING, &buffer_reg, 1))
+			throw(hard_exception(boost::format("io_uring: cannot register buffer ring: %s") % strerror(errno)));
+
+		for(ix = 0; ix < buffers; ix++)
+			add_buffer(ix);
+
+		// kernels without multishot receive fail the request right away
+
+		arm_receive();
+
+		if(io_uring_enter(ring_fd, to_submit, 0, 0, nullptr, 0) < 0)
+			throw(hard_exception(boost::format("io_uring: submit failed: %s") % strerror(errno)));
+
+		to_submit = 0;
+		reap();
+
+		if(!received.empty() && (received.front().res == -EINVAL))
+			throw(hard_exception("io_uring: multishot receive not supported"));
+	}
+	catch(...)
+	{
+		cleanup();
+		throw;
+	}
+}
+
+IoUringBackend::~IoUringBackend() noexcept
+{
+	cleanup();
+}
+
+void IoUringBackend::cleanup() noexcept
+{
+	struct io_uring_sqe *sqe;
+	uint64_t deadline;
+
+	// the multishot receive may write into the buffers until it's cancelled, wait for its final completion
+
+	try
+	{
+		if((ring_fd >= 0) && receive_armed)
+		{
+			sqe = get_sqe();
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->addr = tag_receive;
+			sqe->user_data = tag_cancel;
+
+			deadline = Util::time_usec() + (cancel_timeout_msec * 1000ULL);
+
+			while(receive_armed && (Util::time_usec() < deadline))
+			{
+				wait(deadline);
+
+				for(const auto &cqe : received)
+					if(!(cqe.flags & IORING_CQE_F_MORE))
+						receive_armed = false;
+			}
+		}
+	}
+	catch(const hard_exception &)
+	{
+	}
+
+	if(ring_fd >= 0)
+		close(ring_fd);
+
+	ring_fd = -1;
+
+	if(sqes != MAP_FAILED)
+		munmap(sqes, sqes_size);
+
+	if(sq_ring != MAP_FAILED)
+		munmap(sq_ring, sq_ring_size);
+
+	sqes = (struct io_uring_sqe *)MAP_FAILED;
+	sq_ring = cq_ring = MAP_FAILED;
+
+	free(buffer_ring);
+	free(buffer_pool);
+	buffer_ring = nullptr;
+	buffer_pool = nullptr;
+}
+
+struct io_uring_sqe *IoUringBackend::get_sqe()
+{
+	struct io_uring_sqe *sqe;
+	unsigned int tail, index;
+
+	tail = *sq_tail;
+
+	if((tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE)) >= ring_entries)
+		throw(hard_exception("io_uring: submission queue full"));
+
+	index = tail & *sq_mask;
+	sqe = &sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sq_array[index] = index;
+	__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+	to_submit++;
+
+	return(sqe);
+}
+
+void IoUringBackend::arm_receive()
+{
+	struct io_uring_sqe *sqe = get_sqe();
+
+	sqe->fd = socket_fd;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->buf_group = buffer_group;
+	sqe->user_data = tag_receive;
+
+	if(datagram)
+	{
+		sqe->opcode = IORING_OP_RECVMSG;
+		sqe->addr = (uint64_t)&receive_msg;
+		sqe->len = 1;
+	}
+	else
+		sqe->opcode = IORING_OP_RECV;
+
+	receive_armed = true;
+}
+
+void IoUringBackend::add_buffer(unsigned int buffer_id) noexcept
+{
+	struct io_uring_buf *buffer;
+
+	// the ring is a plain array of io_uring_buf, the tail overlays the last field of the first entry,
+	// don't use bufs[], in C++ the kernel header's flex array macro puts it at offset 8 instead of 0
+
+	buffer = (struct io_uring_buf *)buffer_ring + (buffer_ring_tail & (buffers - 1));
+	buffer->addr = (uint64_t)(buffer_pool + (buffer_id * buffer_size));
+	buffer->len = buffer_size;
+	buffer->bid = buffer_id;
+	buffer_ring_tail++;
+
+	__atomic_store_n(&buffer_ring->tail, buffer_ring_tail, __ATOMIC_RELEASE);
+}
+
+// move all completions out of the completion queue, receive completions are queued until receive() takes them
+
+unsigned int IoUringBackend::reap() noexcept
+{
+	unsigned int head, tail, count;
+	struct io_uring_cqe *cqe;
+
+	head = *cq_head;
+	tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+	for(count = 0; head != tail; head++, count++)
+	{
+		cqe = &cqes[head & *cq_mask];
+
+		switch(cqe->user_data)
+		{
+			case(tag_receive):
+			{
+				received.push_back(*cqe);
+				break;
+			}
+
+			case(tag_send):
+			{
+				send_done = true;
+				send_result = cqe->res;
+				break;
+			}
+
+			default:
+			{
+				break;
+			}
+		}
+	}
+
+	__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+	return(count);
+}
+
+// submit what's queued and wait until at least one completion arrived or the deadline (0 = none) passed,
+// returns 1 for progress, 0 for timeout
+
+int IoUringBackend::wait(uint64_t deadline_usec)
+{
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg;
+	uint64_t now, remaining;
+	int rv;
+
+	if(deadline_usec != 0)
+	{
+		now = Util::time_usec();
+		remaining = (deadline_usec > now) ? (deadline_usec - now) : 0;
+	}
+	else
+		remaining = 0;
+
+	memset(&arg, 0, sizeof(arg));
+	arg.sigmask_sz = _NSIG / 8;
+
+	if(deadline_usec != 0)
+	{
+		ts.tv_sec = remaining / 1000000;
+		ts.tv_nsec = (remaining % 1000000) * 1000;
+		arg.ts = (uint64_t)&ts;
+	}
+
+	if((deadline_usec != 0) && (remaining == 0))
+		rv = io_uring_enter(ring_fd, to_submit, 0, IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+	else
+		rv = io_uring_enter(ring_fd, to_submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+
+	if(rv < 0)
+	{
+		if((errno != ETIME) && (errno != EINTR))
+			throw(hard_exception(boost::format("io_uring: enter failed: %s") % strerror(errno)));
+	}
+	else
+		to_submit -= std::min((unsigned int)rv, to_submit);
+
+	return(reap() > 0 ? 1 : 0);
+}
+
+// the data stays valid until the next call to receive() or release()
+
+int IoUringBackend::receive(std::string_view &data, int timeout, struct sockaddr_in *remote_host)
+{
+	struct io_uring_cqe cqe;
+	const struct io_uring_recvmsg_out *out;
+	const char *buffer;
+	uint64_t deadline;
+	size_t offset;
+
+	release();
+
+	deadline = Util::time_usec() + (timeout * 1000ULL);
+
+	for(;;)
+	{
+		if(!receive_armed)
+			arm_receive();
+
+		reap();
+
+		if(!received.empty())
+		{
+			cqe = received.front();
+			received.pop_front();
+
+			if(!(cqe.flags & IORING_CQE_F_MORE))
+				receive_armed = false;
+
+			if(cqe.res < 0)
+			{
+				// out of buffers, the data is still in the socket, rearm and try again
+
+				if(cqe.res == -ENOBUFS)
+					continue;
+
+				errno = -cqe.res;
+				return(-1);
+			}
+
+			if(!(cqe.flags & IORING_CQE_F_BUFFER))
+			{
+				errno = ECONNRESET;
+				return(-1);
+			}
+
+			held_buffer = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+			buffer = buffer_pool + (held_buffer * buffer_size);
+
+			if(!datagram)
+			{
+				if(cqe.res == 0)
+				{
+					errno = ECONNRESET;
+					return(-1);
+				}
+
+				data = std::string_view(buffer, cqe.res);
+				return(1);
+			}
+
+			out = (const struct io_uring_recvmsg_out *)buffer;
+			offset = sizeof(*out) + receive_msg.msg_namelen + receive_msg.msg_controllen;
+
+			if((size_t)cqe.res < offset)
+			{
+				release();
+				continue;
+			}
+
+			if(remote_host)
+				memcpy(remote_host, buffer + sizeof(*out), sizeof(*remote_host));
+
+			data = std::string_view(buffer + offset, std::min((size_t)out->payloadlen, cqe.res - offset));
+			return(1);
+		}
+
+		if(wait(deadline) == 0)
+		{
+			if(Util::time_usec() >= deadline)
+				return(0);
+		}
+	}
+}
+
+void IoUringBackend::release() noexcept
+{
+	if(held_buffer < 0)
+		return;
+
+	add_buffer(held_buffer);
+	held_buffer = -1;
+}
+
+// returns the number of bytes sent, 0 on timeout, -1 on error
+
+ssize_t IoUringBackend::send(const struct msghdr *msg, int timeout)
+{
+	struct io_uring_sqe *sqe;
+	uint64_t deadline;
+
+	sqe = get_sqe();
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = socket_fd;
+	sqe->addr = (uint64_t)msg;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = tag_send;
+
+	send_done = false;
+	deadline = Util::time_usec() + (timeout * 1000ULL);
+
+	while(!send_done)
+	{
+		if((wait(deadline) == 0) && (Util::time_usec() >= deadline))
+			break;
+	}
+
+	// msg belongs to the caller, so a send that's still pending must be cancelled and waited for
+
+	if(!send_done)
+	{
+		sqe = get_sqe();
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = tag_send;
+		sqe->user_data = tag_cancel;
+
+		while(!send_done)
+			wait(0);
+
+		return(0);
+	}
+
+	if(send_result < 0)
+	{
+		errno = -send_result;
+		return(-1);
+	}
+
+	return(send_result);
+}
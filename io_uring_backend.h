@@ -0,0 +1,79 @@
+#ifndef _io_uring_backend_h_
+#define _io_uring_backend_h_
+
+#include <string_view>
+#include <deque>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/io_uring.h>
+
+// io_uring transport for GenericSocket, using raw system calls (no liburing).
+// Receive is one multishot recv(msg) into a ring of provided buffers, so a datagram that has already arrived costs
+// no system call at all, send submits and waits for completion in one call, instead of poll() + sendmsg().
+// Construction throws if the kernel lacks any of the features used, the caller then falls back to poll().
+
+class IoUringBackend
+{
+	friend class GenericSocket;
+
+	protected:
+
+		IoUringBackend(const IoUringBackend &) = delete;
+		IoUringBackend(int socket_fd, bool datagram, unsigned int payload_size);
+		~IoUringBackend() noexcept;
+
+		ssize_t send(const struct msghdr *msg, int timeout);
+		int receive(std::string_view &data, int timeout, struct sockaddr_in *remote_host = nullptr);
+		void release() noexcept;
+
+	private:
+
+		enum
+		{
+			ring_entries = 8,
+			buffers = 64,
+			buffer_group = 0,
+			tag_receive = 1,
+			tag_send = 2,
+			tag_cancel = 3,
+			cancel_timeout_msec = 100,
+		};
+
+		int ring_fd;
+		int socket_fd;
+		bool datagram;
+		unsigned int buffer_size;
+		char *buffer_pool;
+		struct io_uring_buf_ring *buffer_ring;
+		uint16_t buffer_ring_tail;
+		int held_buffer;
+		void *sq_ring;
+		size_t sq_ring_size;
+		void *cq_ring;
+		size_t cq_ring_size;
+		struct io_uring_sqe *sqes;
+		size_t sqes_size;
+		unsigned int *sq_head;
+		unsigned int *sq_tail;
+		unsigned int *sq_mask;
+		unsigned int *sq_array;
+		unsigned int *cq_head;
+		unsigned int *cq_tail;
+		unsigned int *cq_mask;
+		struct io_uring_cqe *cqes;
+		unsigned int to_submit;
+		bool receive_armed;
+		struct msghdr receive_msg;
+		std::deque<struct io_uring_cqe> received;
+		bool send_done;
+		int send_result;
+
+		void cleanup() noexcept;
+		struct io_uring_sqe *get_sqe();
+		void arm_receive();
+		void add_buffer(unsigned int buffer_id) noexcept;
+		unsigned int reap() noexcept;
+		int wait(uint64_t deadline_usec);
+};
+#endif
@@ -0,0 +1,171 @@
+#include "lzss.h"
+#include "packet.h"
+
+#include <string>
+#include <vector>
+#include <string.h>
+
+unsigned int Lzss::hash(const unsigned char *data) noexcept
+{
+	return(((data[0] << 8) ^ (data[1] << 4) ^ data[2]) & ((1 << hash_bits) - 1));
+}
+
+// greedy, the longest match among the last chain_max positions with the same hash,
+// returns false if the result isn't smaller than the input, dst is undefined then
+
+bool Lzss::compress(std::string_view src_view, std::string &dst)
+{
+	const unsigned char *src = (const unsigned char *)src_view.data();
+	size_t length = src_view.length();
+	std::vector<int> head(1 << hash_bits, -1);
+	std::vector<int> previous(oob_compression_distance_max, -1);
+	oob_compression_header_t header;
+	size_t position, control, best_length, match_length, limit, inserted;
+	unsigned int item, chain, best_distance, token;
+	int candidate, next;
+
+	next = -1;
+
+	header.length = length;
+	dst.assign((const char *)&header, sizeof(header));
+
+	position = 0;
+
+	while(position < length)
+	{
+		control = dst.length();
+		dst.push_back(0);
+
+		for(item = 0; (item < 8) && (position < length); item++)
+		{
+			best_length = 0;
+			best_distance = 0;
+
+			if((position + oob_compression_length_min) <= length)
+			{
+				limit = std::min(length - position, (size_t)oob_compression_length_max);
+
+				for(candidate = head[hash(src + position)], chain = 0;
+						(candidate >= 0) && (chain < chain_max) && ((position - candidate) <= oob_compression_distance_max);
+						candidate = next, chain++)
+				{
+					for(match_length = 0; (match_length < limit) && (src[candidate + match_length] == src[position + match_length]); match_length++)
+						;
+
+					if(match_length > best_length)
+					{
+						best_length = match_length;
+						best_distance = position - candidate;
+
+						if(best_length == limit)
+							break;
+					}
+
+					// the chain is a ring, an entry that was overwritten points forward, end of chain
+
+					if((next = previous[candidate % oob_compression_distance_max]) >= candidate)
+						break;
+				}
+			}
+
+			if(best_length >= oob_compression_length_min)
+			{
+				dst[control] |= 1 << item;
+
+				token = (best_distance - 1) | ((std::min(best_length, (size_t)oob_compression_length_extend) - oob_compression_length_min) << 12);
+				dst.push_back(token & 0xff);
+				dst.push_back(token >> 8);
+
+				if(best_length >= oob_compression_length_extend)
+					dst.push_back(best_length - oob_compression_length_extend);
+			}
+			else
+			{
+				best_length = 1;
+				dst.push_back(src[position]);
+			}
+
+			for(inserted = 0; inserted < best_length; inserted++, position++)
+			{
+				if((position + oob_compression_length_min) > length)
+					continue;
+
+				previous[position % oob_compression_distance_max] = head[hash(src + position)];
+				head[hash(src + position)] = position;
+			}
+		}
+
+		if(dst.length() >= length)
+			return(false);
+	}
+
+	return(dst.length() < length);
+}
+
+// strict, anything that would read or write out of bounds fails
+
+bool Lzss::decompress(std::string_view src_view, std::string &dst, size_t length_max)
+{
+	const unsigned char *src = (const unsigned char *)src_view.data();
+	size_t length = src_view.length();
+	oob_compression_header_t header;
+	size_t position, match_length, distance, match;
+	unsigned int control, item, token;
+
+	if(length < sizeof(header))
+		return(false);
+
+	memcpy(&header, src, sizeof(header));
+
+	if(header.length > length_max)
+		return(false);
+
+	dst.clear();
+	dst.reserve(header.length);
+	position = sizeof(header);
+
+	while(dst.length() < header.length)
+	{
+		if(position >= length)
+			return(false);
+
+		control = src[position++];
+
+		for(item = 0; (item < 8) && (dst.length() < header.length); item++)
+		{
+			if(!(control & (1 << item)))
+			{
+				if(position >= length)
+					return(false);
+
+				dst.push_back(src[position++]);
+				continue;
+			}
+
+			if((position + 2) > length)
+				return(false);
+
+			token = src[position] | (src[position + 1] << 8);
+			position += 2;
+
+			distance = (token & 0x0fff) + 1;
+			match_length = (token >> 12) + oob_compression_length_min;
+
+			if(match_length == oob_compression_length_extend)
+			{
+				if(position >= length)
+					return(false);
+
+				match_length += src[position++];
+			}
+
+			if((distance > dst.length()) || (match_length > (header.length - dst.length())))
+				return(false);
+
+			for(match = dst.length() - distance; match_length > 0; match_length--)
+				dst.push_back(dst[match++]);
+		}
+	}
+
+	return(position == length);
+}
@@ -0,0 +1,32 @@
+#ifndef _lzss_h_
+#define _lzss_h_
+
+#include <string>
+#include <string_view>
+#include <stdint.h>
+
+// oob data compression, the format is in ota.h (oob_compression_header_t),
+// small window lzss, so the esp8266 can decompress into the sector buffer it needs anyway
+
+class Lzss
+{
+	friend class Packet;
+	friend class Util;
+	friend class Espif;
+
+	protected:
+
+		static bool compress(std::string_view src, std::string &dst);
+		static bool decompress(std::string_view src, std::string &dst, size_t length_max);
+
+	private:
+
+		enum
+		{
+			hash_bits = 12,
+			chain_max = 32,
+		};
+
+		static unsigned int hash(const unsigned char *data) noexcept;
+};
+#endif
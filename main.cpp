@@ -1,4 +1,5 @@
 #include "espif.h"
+#include "fleet.h"
 #include "exception.h"
 
 #include <fstream>
@@ -23,6 +24,21 @@ static bool option_use_tcp = false;
 static bool option_dontwait = false;
 static unsigned int option_broadcast_group_mask = 0;
 static unsigned int option_multicast_burst = 1;
+static unsigned int option_multicast_hosts = 0;
+static bool option_stream = false;
+static unsigned int option_window = 1;
+static bool option_no_pacing = false;
+static unsigned int option_transfer_sectors = 1;
+static unsigned int option_packet_version = 3;
+static bool option_no_crc32c = false;
+static bool option_io_uring = false;
+static bool option_no_multi_command = false;
+static unsigned int option_busy_poll = 0;
+static bool option_probe_payload = false;
+static std::string option_faults;
+static bool option_compress = false;
+static bool option_delta = false;
+static bool option_checksum_verify = false;
 
 int main(int argc_in, const char **argv_in)
 {
@@ -37,6 +53,7 @@ int main(int argc_in, const char **argv_in)
 		std::vector<std::string> proxy_signal_ids;
 		std::string host;
 		std::string args;
+		std::string script_filename;
 		std::string command_port;
 		std::string filename;
 		std::string start_string;
@@ -56,6 +73,9 @@ int main(int argc_in, const char **argv_in)
 		bool cmd_simulate = false;
 		bool cmd_verify = false;
 		bool cmd_benchmark = false;
+		bool cmd_benchmark_backends = false;
+		bool cmd_benchmark_latency = false;
+		bool cmd_benchmark_faults = false;
 		bool cmd_image = false;
 		bool cmd_proxy = false;
 		bool cmd_image_epaper = false;
@@ -63,6 +83,7 @@ int main(int argc_in, const char **argv_in)
 		bool cmd_multicast = false;
 		bool cmd_read = false;
 		bool cmd_info = false;
+		bool cmd_fleet = false;
 		unsigned int selected;
 
 		for(current_argv_index = 1; current_argv_index < argc_in; current_argv_index++)
@@ -111,6 +132,9 @@ int main(int argc_in, const char **argv_in)
 			("simulate,S",				po::bool_switch(&cmd_simulate)->implicit_value(true),						"WRITE simulate")
 			("write,W",					po::bool_switch(&cmd_write)->implicit_value(true),							"WRITE")
 			("benchmark,B",				po::bool_switch(&cmd_benchmark)->implicit_value(true),						"BENCHMARK")
+			("benchmark-backends",		po::bool_switch(&cmd_benchmark_backends)->implicit_value(true),				"BENCHMARK round trips over the poll and io_uring backends")
+			("benchmark-latency",		po::bool_switch(&cmd_benchmark_latency)->implicit_value(true),				"BENCHMARK round trip latency, with and without busy polling")
+			("benchmark-faults",		po::bool_switch(&cmd_benchmark_faults)->implicit_value(true),				"BENCHMARK goodput and retries under injected network faults (udp)")
 			("image,I",					po::bool_switch(&cmd_image)->implicit_value(true),							"SEND IMAGE")
 			("proxy,P",					po::bool_switch(&cmd_proxy)->implicit_value(true),							"START PROXY")
 			("proxy-signal-id,q",		po::value<std::vector<std::string> >(&proxy_signal_ids),					"PROXY signal ids to listen to")
@@ -119,6 +143,7 @@ int main(int argc_in, const char **argv_in)
 			("epaper-image,e",			po::bool_switch(&cmd_image_epaper)->implicit_value(true),					"SEND EPAPER IMAGE (uc8151d connected to host)")
 			("broadcast,b",				po::bool_switch(&cmd_broadcast)->implicit_value(true),						"BROADCAST SENDER send broadcast message")
 			("multicast,M",				po::bool_switch(&cmd_multicast)->implicit_value(true),						"MULTICAST SENDER send multicast message")
+			("fleet,F",					po::bool_switch(&cmd_fleet)->implicit_value(true),							"FLEET send command to all hosts at once, host is a comma separated list of host[:port]")
 			("host,h",					po::value<std::vector<std::string> >(&host_args)->required(),				"host or broadcast address or multicast group to use")
 			("verbose,v",				po::bool_switch(&option_verbose)->implicit_value(true),						"verbose output")
 			("debug,D",					po::bool_switch(&option_debug)->implicit_value(true),						"packet trace etc.")
@@ -137,7 +162,23 @@ int main(int argc_in, const char **argv_in)
 			("no-request-checksum,2",	po::bool_switch(&option_no_request_checksum)->implicit_value(true),			"do not request checksum")
 			("raw,r",					po::bool_switch(&option_raw)->implicit_value(true),							"do not use packet encapsulation")
 			("broadcast-groups,g",		po::value<unsigned int>(&option_broadcast_group_mask)->default_value(0),	"select broadcast groups (bitfield)")
-			("burst,u",					po::value<unsigned int>(&option_multicast_burst)->default_value(1),			"burst broadcast and multicast packets multiple times");
+			("burst,u",					po::value<unsigned int>(&option_multicast_burst)->default_value(1),			"burst broadcast and multicast packets multiple times")
+			("hosts",					po::value<unsigned int>(&option_multicast_hosts)->default_value(0),			"number of devices expected to reply to broadcast and multicast packets, stop when all did")
+			("stream",					po::bool_switch(&option_stream)->implicit_value(true),						"show broadcast and multicast replies as they arrive")
+			("window,w",				po::value<unsigned int>(&option_window)->default_value(1),					"keep this many flash transfer packets in flight")
+			("no-pacing",				po::bool_switch(&option_no_pacing)->implicit_value(true),					"do not pace (rate limit) transfers")
+			("transfer-sectors,c",		po::value<unsigned int>(&option_transfer_sectors)->default_value(1),		"transfer up to this many flash sectors per packet, if the device supports it")
+			("packet-version",			po::value<unsigned int>(&option_packet_version)->default_value(3),			"use up to this packet version (2 or 3), if the device supports it")
+			("no-crc32c",				po::bool_switch(&option_no_crc32c)->implicit_value(true),					"use md5_32 instead of crc32c as checksum on version 3 packets")
+			("io-uring",				po::bool_switch(&option_io_uring)->implicit_value(true),					"use io_uring instead of poll for socket i/o, if the kernel supports it")
+			("script",					po::value<std::string>(&script_filename),									"send the commands in this file, one per line, after the commands from the command line")
+			("no-multi-command",		po::bool_switch(&option_no_multi_command)->implicit_value(true),			"send one command per packet, even if the device can take more")
+			("busy-poll",				po::value<unsigned int>(&option_busy_poll)->default_value(0),				"low latency: spin for up to this many microseconds waiting for a reply, before sleeping")
+			("probe-payload",			po::bool_switch(&option_probe_payload)->implicit_value(true),				"find the largest payload the device (path) reliably takes and use it for image and transfer chunks, cached per host")
+			("compress",				po::bool_switch(&option_compress)->implicit_value(true),					"compress flash data (oob) to and from the device, if it supports it")
+			("delta",					po::bool_switch(&option_delta)->implicit_value(true),						"write: only send the sectors whose checksum differs from what's in flash already")
+			("checksum-verify",			po::bool_switch(&option_checksum_verify)->implicit_value(true),				"verify: compare checksums instead of reading back all data, bisect to find the sectors that differ")
+			("faults",					po::value<std::string>(&option_faults)->default_value(""),					"testing: inject udp faults, e.g. loss=0.05,duplicate=0.01,reorder=0.01,corrupt=0.001,delay=10,jitter=5,seed=1");
 
 		po::positional_options_description positional_options;
 		positional_options.add("host", -1);
@@ -159,6 +200,31 @@ int main(int argc_in, const char **argv_in)
 			args.append(*it);
 		}
 
+		// unlike @file, which only adds words to the command line, a script keeps its lines, one command per line,
+		// so they can be sent together in a multi command packet
+
+		if(!script_filename.empty())
+		{
+			std::ifstream file;
+			std::string line;
+
+			file.open(script_filename);
+
+			if(!file.is_open())
+				throw(hard_exception(boost::format("cannot open script \"%s\"") % script_filename));
+
+			while(std::getline(file, line))
+			{
+				if(line.empty() || (line[0] == '#'))
+					continue;
+
+				if(!args.empty())
+					args.append("\n");
+
+				args.append(line);
+			}
+		}
+
 		if(option_broadcast_group_mask)
 			cmd_broadcast = true;
 
@@ -179,6 +245,15 @@ int main(int argc_in, const char **argv_in)
 		if(cmd_benchmark)
 			selected++;
 
+		if(cmd_benchmark_backends)
+			selected++;
+
+		if(cmd_benchmark_latency)
+			selected++;
+
+		if(cmd_benchmark_faults)
+			selected++;
+
 		if(cmd_image)
 			selected++;
 
@@ -197,34 +272,76 @@ int main(int argc_in, const char **argv_in)
 		if(cmd_multicast)
 			selected++;
 
+		if(cmd_fleet)
+			selected++;
+
 		if(selected > 1)
-			throw(hard_exception("specify one of write/simulate/verify/image/epaper-image/read/info"));
+			throw(hard_exception("specify one of write/simulate/verify/image/epaper-image/read/info/fleet"));
 
-		Espif espif(
-			EspifConfig
-			{
-				.host = host,
-				.command_port = command_port,
-				.use_tcp = option_use_tcp,
-				.broadcast = cmd_broadcast,
-				.multicast = cmd_multicast,
-				.debug = option_debug,
-				.verbose = option_verbose,
-				.dontwait = option_dontwait,
-				.broadcast_group_mask = option_broadcast_group_mask,
-				.multicast_burst = option_multicast_burst,
-				.raw = option_raw,
-				.provide_checksum = !option_no_provide_checksum,
-				.request_checksum = !option_no_request_checksum
-			}
-		);
+		if(option_transfer_sectors > EspifConfig::transfer_sectors_max)
+			throw(hard_exception(boost::format("transfer sectors: at most %u") % EspifConfig::transfer_sectors_max));
+
+		EspifConfig config
+		{
+			.host = host,
+			.command_port = command_port,
+			.use_tcp = option_use_tcp,
+			.broadcast = cmd_broadcast,
+			.multicast = cmd_multicast,
+			.debug = option_debug,
+			.verbose = option_verbose,
+			.dontwait = option_dontwait,
+			.broadcast_group_mask = option_broadcast_group_mask,
+			.multicast_burst = option_multicast_burst,
+			.multicast_hosts = option_multicast_hosts,
+			.raw = option_raw,
+			.provide_checksum = !option_no_provide_checksum,
+			.request_checksum = !option_no_request_checksum,
+			.window = option_window,
+			.pacing = !option_no_pacing,
+			.transfer_sectors = option_transfer_sectors,
+			.packet_version = option_packet_version,
+			.crc32c = !option_no_crc32c,
+			.io_uring = option_io_uring,
+			.multi_command = !option_no_multi_command,
+			.busy_poll_usec = option_busy_poll,
+			.payload_probe = option_probe_payload,
+			.faults = option_faults,
+			.oob_compression = option_compress,
+			.delta_write = option_delta,
+			.checksum_verify = option_checksum_verify
+		};
+
+		if(cmd_fleet)
+		{
+			std::vector<std::string> fleet_hosts;
+			typedef boost::char_separator<char> separator_t;
+			separator_t separator(",");
+			typedef boost::tokenizer<separator_t> tokenizer_t;
+			tokenizer_t tokenizer(host, separator);
+
+			for(tokenizer_t::const_iterator token = tokenizer.begin(); token != tokenizer.end(); token++)
+				fleet_hosts.push_back(*token);
+
+			Fleet fleet(config, fleet_hosts);
+			std::cout << fleet.send(args);
+
+			return(0);
+		}
+
+		Espif espif(config);
 
 		if(selected == 0)
 			std::cout << espif.send(args);
 		else
 		{
 			if(cmd_broadcast || cmd_multicast)
-				std::cout << espif.multicast(args);
+			{
+				if(option_stream)
+					std::cout << espif.multicast(args, [](const std::string &line) { std::cout << line << std::flush; });
+				else
+					std::cout << espif.multicast(args);
+			}
 			else
 			{
 				if(cmd_proxy)
@@ -300,7 +417,7 @@ int main(int argc_in, const char **argv_in)
 							otawrite = true;
 						}
 						else
-							if(!cmd_benchmark && !cmd_image && !cmd_image_epaper && !cmd_proxy)
+							if(!cmd_benchmark && !cmd_benchmark_backends && !cmd_benchmark_latency && !cmd_benchmark_faults && !cmd_image && !cmd_image_epaper && !cmd_proxy)
 								throw(hard_exception("start address not set"));
 					}
 
@@ -324,11 +441,20 @@ int main(int argc_in, const char **argv_in)
 									if(cmd_benchmark)
 										espif.benchmark(length);
 									else
-										if(cmd_image)
-											espif.image(image_slot, filename, dim_x, dim_y, depth, image_timeout);
+										if(cmd_benchmark_backends)
+											espif.benchmark_backends(length);
 										else
-											if(cmd_image_epaper)
-												espif.image_epaper(filename);
+											if(cmd_benchmark_latency)
+												espif.benchmark_latency(length);
+											else
+												if(cmd_benchmark_faults)
+													espif.benchmark_faults((start < 0) ? 0 : start);
+												else
+													if(cmd_image)
+														espif.image(image_slot, filename, dim_x, dim_y, depth, image_timeout);
+													else
+														if(cmd_image_epaper)
+															espif.image_epaper(filename);
 				}
 			}
 		}
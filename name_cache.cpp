@@ -0,0 +1,118 @@
+#include "name_cache.h"
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <iostream>
+#include <string.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <boost/format.hpp>
+#include <boost/thread.hpp>
+
+NameCache::NameCache(const EspifConfig &config_in) : config(config_in), cache("names")
+{
+}
+
+NameCache::~NameCache() noexcept
+{
+}
+
+void NameCache::save() noexcept
+{
+	cache.save();
+}
+
+std::string NameCache::key(uint32_t host_id)
+{
+	return((boost::format("%08x") % host_id).str());
+}
+
+bool NameCache::lookup(uint32_t host_id, std::string &name) const
+{
+	return(cache.lookup(key(host_id), name));
+}
+
+// addresses without a name (or a failing resolver) get their numeric form, cached for a shorter time,
+// a new device may get a name soon
+
+bool NameCache::resolve_one(uint32_t host_id, std::string &name) noexcept
+{
+	struct sockaddr_in address;
+	char host_buffer[256];
+	int gai_error;
+
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(host_id);
+
+	gai_error = getnameinfo((struct sockaddr *)&address, sizeof(address), host_buffer, sizeof(host_buffer),
+			nullptr, 0, NI_DGRAM | NI_NOFQDN | NI_NAMEREQD);
+
+	if(gai_error == 0)
+	{
+		name = host_buffer;
+		return(true);
+	}
+
+	if(inet_ntop(AF_INET, &address.sin_addr, host_buffer, sizeof(host_buffer)))
+		name = host_buffer;
+	else
+		name = "0.0.0.0";
+
+	return(false);
+}
+
+// resolve every address that isn't in the cache, at most resolvers_max lookups in flight,
+// so a slow resolver costs one timeout for the whole scan instead of one per host
+
+void NameCache::resolve(const std::vector<uint32_t> &host_ids)
+{
+	std::vector<uint32_t> missing;
+	std::vector<std::string> names;
+	std::vector<char> found;
+	std::atomic<unsigned int> next;
+	boost::thread_group resolvers;
+	unsigned int ix, threads;
+	std::string name;
+
+	for(const auto &host_id : host_ids)
+		if(!lookup(host_id, name))
+			missing.push_back(host_id);
+
+	if(missing.empty())
+	{
+		if(config.verbose)
+			std::cout << boost::format("names: %u cached") % host_ids.size() << std::endl;
+		return;
+	}
+
+	names.resize(missing.size());
+	found.resize(missing.size());
+	next = 0;
+
+	threads = std::min(missing.size(), (size_t)resolvers_max);
+
+	for(ix = 0; ix < threads; ix++)
+		resolvers.create_thread([&]()
+		{
+			unsigned int current;
+
+			while((current = next++) < missing.size())
+				found[current] = resolve_one(missing[current], names[current]);
+		});
+
+	resolvers.join_all();
+
+	for(ix = 0; ix < missing.size(); ix++)
+	{
+		if(config.verbose && !found[ix])
+			std::cout << boost::format("cannot resolve: %s") % names[ix] << std::endl;
+
+		cache.store(key(missing[ix]), names[ix], found[ix] ? ttl_seconds : negative_ttl_seconds);
+	}
+
+	if(config.verbose)
+		std::cout << boost::format("names: %u cached, %u resolved with %u threads") %
+				(host_ids.size() - missing.size()) % missing.size() % threads << std::endl;
+}
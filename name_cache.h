@@ -0,0 +1,43 @@
+#ifndef _name_cache_h_
+#define _name_cache_h_
+
+#include "espifconfig.h"
+#include "host_cache.h"
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// reverse dns for broadcast and multicast replies, kept out of the receive loop:
+// the replies are collected first, then all unknown addresses are resolved in parallel,
+// the names are kept with a ttl, in memory and in ~/.espif-names, so a repeated scan doesn't need dns at all
+
+class NameCache
+{
+	public:
+
+		NameCache() = delete;
+		NameCache(const NameCache &) = delete;
+		NameCache(const EspifConfig &);
+		~NameCache() noexcept;
+
+		void resolve(const std::vector<uint32_t> &host_ids);
+		bool lookup(uint32_t host_id, std::string &name) const;
+		void save() noexcept;
+
+	private:
+
+		enum
+		{
+			ttl_seconds = 3600,
+			negative_ttl_seconds = 300,
+			resolvers_max = 16,
+		};
+
+		const EspifConfig config;
+		HostCache cache;
+
+		static std::string key(uint32_t host_id);
+		static bool resolve_one(uint32_t host_id, std::string &name) noexcept;
+};
+#endif
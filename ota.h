@@ -13,6 +13,7 @@ enum
 {
 	packet_header_soh = 0x01,
 	packet_header_version = 2,
+	packet_header_version_3 = 3,
 	packet_header_id = 0x4afb,
 };
 
@@ -33,12 +34,12 @@ typedef struct attr_packed
 			unsigned int md5_32_requested:1;
 			unsigned int md5_32_provided:1;
 			unsigned int transaction_id_provided:1;
-			unsigned int spare_3:1;
-			unsigned int spare_4:1;
-			unsigned int spare_5:1;
-			unsigned int spare_6:1;
-			unsigned int spare_7:1;
-			unsigned int spare_8:1;
+			unsigned int version_3_supported:1;
+			unsigned int crc32c_requested:1;
+			unsigned int crc32c_provided:1;
+			unsigned int multi_command:1;
+			unsigned int oob_compressed:1;
+			unsigned int oob_compression_supported:1;
 			unsigned int spare_9:1;
 			unsigned int spare_10:1;
 			unsigned int spare_11:1;
@@ -71,11 +72,137 @@ assert_field(packet_header_t, spare_1, 24);
 assert_field(packet_header_t, checksum, 28);
 assert_size(packet_header_t, 32);
 
+// version 3: same flags, 32 bit lengths and offsets, optional crc32c instead of md5_32 as checksum
+// a version 2 packet with version_3_supported set may be answered with a version 3 packet
+
+typedef struct attr_packed
+{
+	uint8_t soh;						// 0
+	uint8_t version;					// 1
+	uint16_t id;						// 2
+	union
+	{
+		struct attr_packed
+		{
+			unsigned int md5_32_requested:1;
+			unsigned int md5_32_provided:1;
+			unsigned int transaction_id_provided:1;
+			unsigned int version_3_supported:1;
+			unsigned int crc32c_requested:1;
+			unsigned int crc32c_provided:1;
+			unsigned int multi_command:1;
+			unsigned int oob_compressed:1;
+			unsigned int oob_compression_supported:1;
+			unsigned int spare_9:1;
+			unsigned int spare_10:1;
+			unsigned int spare_11:1;
+			unsigned int spare_12:1;
+			unsigned int spare_13:1;
+			unsigned int spare_14:1;
+			unsigned int spare_15:1;
+		} flag;							// 4
+		uint16_t flags;					// 4
+	};
+	uint16_t broadcast_groups;			// 6
+	uint32_t length;					// 8
+	uint32_t data_offset;				// 12
+	uint32_t data_pad_offset;			// 16
+	uint32_t oob_data_offset;			// 20
+	uint32_t transaction_id;			// 24
+	uint32_t checksum;					// 28
+} packet_header_3_t;
+
+assert_field(packet_header_3_t, soh, 0);
+assert_field(packet_header_3_t, version, 1);
+assert_field(packet_header_3_t, id, 2);
+assert_field(packet_header_3_t, flag, 4);
+assert_field(packet_header_3_t, flags, 4);
+assert_field(packet_header_3_t, broadcast_groups, 6);
+assert_field(packet_header_3_t, length, 8);
+assert_field(packet_header_3_t, data_offset, 12);
+assert_field(packet_header_3_t, data_pad_offset, 16);
+assert_field(packet_header_3_t, oob_data_offset, 20);
+assert_field(packet_header_3_t, transaction_id, 24);
+assert_field(packet_header_3_t, checksum, 28);
+assert_size(packet_header_3_t, 32);
+
+// a packet with multi_command set has one command per line in the data, they're run in order,
+// the reply has multi_command set too, its oob data has a record for every command run, possibly less than sent
+// when the reply is full, each record is this header followed by the reply text and the reply oob data,
+// padded to a multiple of 4 bytes, the request can't have oob data,
+// firmware that doesn't know about this runs the data as one command and replies without multi_command,
+// so the first multi_command packet of a session should only have one command
+
+enum
+{
+	multi_command_status_ok = 0,
+	multi_command_status_error = 1,
+};
+
+typedef struct attr_packed
+{
+	uint16_t length;					// 0
+	uint16_t oob_length;				// 2
+	uint8_t status;						// 4
+	uint8_t spare[3];					// 5
+} multi_command_reply_t;
+
+assert_field(multi_command_reply_t, length, 0);
+assert_field(multi_command_reply_t, oob_length, 2);
+assert_field(multi_command_reply_t, status, 4);
+assert_size(multi_command_reply_t, 8);
+
+// a packet with oob_compressed set has compressed oob data, the checksum covers the packet as sent,
+// oob_compression_supported in a request means the sender takes compressed oob data in the reply,
+// firmware that sets it in its replies takes compressed oob data in requests,
+// compressed oob data is this header followed by lzss data: a control byte before every 8 items, bit 0 first,
+// 0: a literal byte, 1: a match, 16 bits little endian, bits 0-11: distance - 1, bits 12-15: length - 3,
+// when the length bits are all ones, one more byte follows that is added to the length,
+// a match copies from the data decompressed so far and may overlap itself (runs of the same byte),
+// the window is the output buffer itself, so decompressing doesn't need any memory besides that
+
+enum
+{
+	oob_compression_distance_max = 4096,
+	oob_compression_length_min = 3,
+	oob_compression_length_extend = 18,
+	oob_compression_length_max = 18 + 255,
+};
+
+typedef struct attr_packed
+{
+	uint32_t length;					// 0
+} oob_compression_header_t;
+
+assert_field(oob_compression_header_t, length, 0);
+assert_size(oob_compression_header_t, 4);
+
+// flash-checksum-list <sector> <sectors>: the sha1 of each sector, packed, flash_checksum_list_digest_size bytes each,
+// in the reply oob data, reply "OK flash-checksum-list: checksummed <n> sectors from sector <s>",
+// n may be less than asked for, if the reply is full, firmware that doesn't know about this replies with an error
+
+enum
+{
+	flash_checksum_list_digest_size = 20,
+};
+
+// a raw reply (no packet header) ends with packet_raw_end followed by the length of the reply before it,
+// 32 bits little endian, so a tcp stream can be cut exactly, oob data included,
+// the length makes the marker unambiguous in binary oob data, firmware that doesn't send it
+// leaves only the stream going quiet as the end of a raw reply
+
+enum
+{
+	packet_raw_end = 0x04,
+	packet_raw_end_size = 5,
+};
+
 #ifndef __espif__
 app_action_t application_function_flash_info(app_params_t *);
 app_action_t application_function_flash_write(app_params_t *);
 app_action_t application_function_flash_read(app_params_t *);
 app_action_t application_function_flash_checksum(app_params_t *);
+app_action_t application_function_flash_checksum_list(app_params_t *);
 app_action_t application_function_flash_bench(app_params_t *);
 app_action_t application_function_flash_select(app_params_t *);
 #endif
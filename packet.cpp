@@ -1,47 +1,139 @@
 #include "packet.h"
+#include "lzss.h"
+#include "exception.h"
 #include <openssl/evp.h>
 #include <string>
 #include <iostream>
 #include <boost/format.hpp>
+#include <string.h>
+#include <type_traits>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 
 enum
 {
 	md5_hash_size = 16,
+	crc32c_polynomial = 0x82f63b78,
 };
 
-uint32_t Packet::MD5_trunc_32(const std::string &data) noexcept
+uint32_t Packet::MD5_trunc_32(const struct iovec *iov, unsigned int iov_count) noexcept
 {
-	uint8_t hash[md5_hash_size];
 	uint32_t checksum;
-	unsigned int hash_size;
 	EVP_MD_CTX *hash_ctx;
 
 	hash_ctx = EVP_MD_CTX_new();
+	checksum = MD5_trunc_32(hash_ctx, iov, iov_count);
+	EVP_MD_CTX_free(hash_ctx);
+
+	return(checksum);
+}
+
+uint32_t Packet::MD5_trunc_32(EVP_MD_CTX *hash_ctx, const struct iovec *iov, unsigned int iov_count) noexcept
+{
+	uint8_t hash[md5_hash_size];
+	uint32_t checksum;
+	unsigned int hash_size, ix;
+
 	EVP_DigestInit_ex(hash_ctx, EVP_md5(), (ENGINE *)0);
-	EVP_DigestUpdate(hash_ctx, data.data(), data.length());
+
+	for(ix = 0; ix < iov_count; ix++)
+		EVP_DigestUpdate(hash_ctx, iov[ix].iov_base, iov[ix].iov_len);
+
 	hash_size = md5_hash_size;
 	EVP_DigestFinal_ex(hash_ctx, hash, &hash_size);
-	EVP_MD_CTX_free(hash_ctx);
 
 	checksum = (hash[0] << 24) | (hash[1] << 16) | (hash[2] << 8) | (hash[3] << 0);
 
 	return(checksum);
 }
 
+static uint32_t crc32c_software(uint32_t crc, const uint8_t *data, size_t length) noexcept
+{
+	static uint32_t table[256];
+	static bool table_valid = false;
+	unsigned int byte, bit;
+	uint32_t value;
+
+	if(!table_valid)
+	{
+		for(byte = 0; byte < 256; byte++)
+		{
+			value = byte;
+
+			for(bit = 0; bit < 8; bit++)
+				value = (value >> 1) ^ ((value & 1) ? (uint32_t)crc32c_polynomial : 0);
+
+			table[byte] = value;
+		}
+
+		table_valid = true;
+	}
+
+	for(; length > 0; data++, length--)
+		crc = (crc >> 8) ^ table[(crc ^ *data) & 0xff];
+
+	return(crc);
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *data, size_t length) noexcept
+{
+	uint64_t crc64, word;
+
+	crc64 = crc;
+
+	for(; length >= sizeof(word); data += sizeof(word), length -= sizeof(word))
+	{
+		memcpy(&word, data, sizeof(word));
+		crc64 = _mm_crc32_u64(crc64, word);
+	}
+
+	crc = crc64;
+
+	for(; length > 0; data++, length--)
+		crc = _mm_crc32_u8(crc, *data);
+
+	return(crc);
+}
+#endif
+
+static uint32_t crc32c_update(uint32_t crc, const void *data, size_t length) noexcept
+{
+#if defined(__x86_64__)
+	static const bool sse42 = __builtin_cpu_supports("sse4.2");
+
+	if(sse42)
+		return(crc32c_sse42(crc, (const uint8_t *)data, length));
+#endif
+
+	return(crc32c_software(crc, (const uint8_t *)data, length));
+}
+
+uint32_t Packet::CRC32C(const struct iovec *iov, unsigned int iov_count) noexcept
+{
+	uint32_t crc = 0xffffffff;
+	unsigned int ix;
+
+	for(ix = 0; ix < iov_count; ix++)
+		crc = crc32c_update(crc, iov[ix].iov_base, iov[ix].iov_len);
+
+	return(crc ^ 0xffffffff);
+}
+
 void Packet::clear_packet_header() noexcept
 {
 	packet_header.soh = 0;
 	packet_header.version = 0;
 	packet_header.id = 0;
+	packet_header.flags = 0;
+	packet_header.broadcast_groups = 0;
 	packet_header.length = 0;
 	packet_header.data_offset = 0;
 	packet_header.data_pad_offset = 0;
 	packet_header.oob_data_offset = 0;
-	packet_header.broadcast_groups = 0;
-	packet_header.flags = 0;
 	packet_header.transaction_id = 0;
-	packet_header.spare_0 = 0;
-	packet_header.spare_1 = 0;
 	packet_header.checksum = 0;
 }
 
@@ -75,80 +167,268 @@ void Packet::append_oob_data(const std::string &oob_data_in)
 	oob_data.append(oob_data_in);
 }
 
-std::string Packet::encapsulate(bool raw, bool provide_checksum, bool request_checksum, unsigned int broadcast_group_mask, const uint32_t *transaction_id)
+std::string Packet::encapsulate(bool raw, bool provide_checksum, bool request_checksum, unsigned int broadcast_group_mask, const uint32_t *transaction_id,
+		unsigned int version, bool version_3_supported, bool crc32c)
 {
-	std::string pad;
+	Segments segments;
+	struct iovec iov[segments_max];
+	unsigned int iov_count, ix;
 	std::string packet;
 
-	if(raw)
-	{
-		packet = data;
+	PacketCodec codec(raw, provide_checksum, request_checksum, broadcast_group_mask, transaction_id != nullptr, version_3_supported, crc32c);
 
-		if((packet.length() > 0) && (packet.back() != '\n'))
-			packet.append(1, '\n');
+	codec.set_version(version);
+	codec.encapsulate(segments, data, oob_data, transaction_id ? *transaction_id : 0);
 
-		if(oob_data.length() > 0)
-		{
-			packet.append(1, '\0');
+	iov_count = segments.gather(iov);
+	packet.reserve(segments.length());
+
+	for(ix = 0; ix < iov_count; ix++)
+		packet.append((const char *)iov[ix].iov_base, iov[ix].iov_len);
+
+	return(packet);
+}
+
+unsigned int Packet::Segments::gather(struct iovec *iov) const noexcept
+{
+	unsigned int count = 0;
 
-			while((packet.length() % 4) != 0)
-				packet.append(1, '\0');
+	if(header_length > 0)
+		iov[count++] = { .iov_base = const_cast<char *>(header), .iov_len = header_length };
 
-			packet.append(oob_data);
+	if(data.length() > 0)
+		iov[count++] = { .iov_base = const_cast<char *>(data.data()), .iov_len = data.length() };
+
+	if(trailer_length > 0)
+		iov[count++] = { .iov_base = const_cast<char *>(trailer), .iov_len = trailer_length };
+
+	if(oob_data.length() > 0)
+		iov[count++] = { .iov_base = const_cast<char *>(oob_data.data()), .iov_len = oob_data.length() };
+
+	return(count);
+}
+
+size_t Packet::Segments::length() const noexcept
+{
+	return(header_length + data.length() + trailer_length + oob_data.length());
+}
+
+PacketCodec::PacketCodec(bool raw, bool provide_checksum, bool request_checksum_in, unsigned int broadcast_group_mask_in, bool transaction_id,
+		bool version_3_supported_in, bool crc32c_in, bool oob_compression_in) noexcept
+{
+	request_checksum = request_checksum_in;
+	broadcast_group_mask = broadcast_group_mask_in;
+	version = packet_header_version;
+	version_3_supported = version_3_supported_in;
+	crc32c = version_3_supported_in && crc32c_in;
+	oob_compression = oob_compression_in;
+	hash_ctx = nullptr;
+
+	if(raw)
+		encapsulator = &PacketCodec::encapsulate_policy<false, false, false>;
+	else
+	{
+		if(provide_checksum)
+		{
+			if(transaction_id)
+				encapsulator = &PacketCodec::encapsulate_policy<true, true, true>;
+			else
+				encapsulator = &PacketCodec::encapsulate_policy<true, true, false>;
+		}
+		else
+		{
+			if(transaction_id)
+				encapsulator = &PacketCodec::encapsulate_policy<true, false, true>;
+			else
+				encapsulator = &PacketCodec::encapsulate_policy<true, false, false>;
 		}
+
+		hash_ctx = EVP_MD_CTX_new();
 	}
-	else
+}
+
+PacketCodec::~PacketCodec() noexcept
+{
+	if(hash_ctx)
+		EVP_MD_CTX_free(hash_ctx);
+}
+
+void PacketCodec::set_version(unsigned int version_in) noexcept
+{
+	version = version_in;
+}
+
+// flags are extra header flags, e.g. multi_command, raw packets can't carry them
+
+void PacketCodec::encapsulate(Packet::Segments &segments, std::string_view data, std::string_view oob_data, uint32_t transaction_id, unsigned int flags)
+{
+	(this->*encapsulator)(segments, data, oob_data, transaction_id, flags);
+}
+
+void PacketCodec::encapsulate(const std::vector<Request> &requests, std::vector<Packet::Segments> &segments)
+{
+	unsigned int ix;
+
+	segments.resize(requests.size());
+
+	for(ix = 0; ix < requests.size(); ix++)
+		(this->*encapsulator)(segments[ix], requests[ix].data, requests[ix].oob_data, requests[ix].transaction_id, requests[ix].flags);
+}
+
+// replies of this session are checked with the codec's md5 context, no context is made per packet
+
+bool PacketCodec::decapsulate(Packet &packet, std::string_view message, std::string_view &data, std::string_view &oob_data, bool verbose, bool *raw,
+		const uint32_t *transaction_id)
+{
+	return(packet.decapsulate(message, data, oob_data, verbose, raw, transaction_id, hash_ctx));
+}
+
+template<bool framed, bool provide_checksum, bool use_transaction_id> void PacketCodec::encapsulate_policy(Packet::Segments &segments,
+		std::string_view data, std::string_view oob_data, uint32_t transaction_id, unsigned int flags)
+{
+	segments.header_length = 0;
+	segments.data = data;
+	segments.trailer_length = 0;
+	segments.oob_data = oob_data;
+
+	if constexpr(!framed)
 	{
-		clear_packet_header();
+		if((data.length() > 0) && (data.back() != '\n'))
+			segments.trailer[segments.trailer_length++] = '\n';
 
 		if(oob_data.length() > 0)
-			while(((data.length() + pad.length()) % 4) != 0)
-				pad.append(1, '\0');
-
-		packet_header.soh = packet_header_soh;
-		packet_header.version = packet_header_version;
-		packet_header.id = packet_header_id;
-		packet_header.length = sizeof(packet_header) + data.length() + pad.length() + oob_data.length();
-		packet_header.data_offset = sizeof(packet_header);
-		packet_header.data_pad_offset = sizeof(packet_header) + data.length();
-		packet_header.oob_data_offset = sizeof(packet_header) + data.length() + pad.length();
-
-		if(transaction_id)
 		{
-			packet_header.flag.transaction_id_provided = 1;
-			packet_header.transaction_id = *transaction_id;
+			segments.trailer[segments.trailer_length++] = '\0';
+			encapsulate_pad(segments);
 		}
+	}
+	else
+	{
+		if(oob_data.length() > 0)
+			encapsulate_pad(segments);
+
+		if(version == packet_header_version_3)
+			encapsulate_header<packet_header_3_t, provide_checksum, use_transaction_id>(segments, transaction_id, flags);
+		else
+			encapsulate_header<packet_header_t, provide_checksum, use_transaction_id>(segments, transaction_id, flags);
+	}
+}
 
-		if(request_checksum)
-			packet_header.flag.md5_32_requested = 1;
+// oob data starts at a multiple of 4 bytes
 
-		packet_header.broadcast_groups = broadcast_group_mask & ((1 << (sizeof(packet_header.broadcast_groups) * 8)) - 1);
+void PacketCodec::encapsulate_pad(Packet::Segments &segments)
+{
+	unsigned int pad;
 
-		if(provide_checksum)
-		{
-			packet_header.flag.md5_32_provided = 1;
-			std::string packet_checksum = std::string((const char *)&packet_header, sizeof(packet_header)) + data + pad + oob_data;
-			packet_header.checksum = MD5_trunc_32(packet_checksum);
-		}
+	pad = (4 - ((segments.data.length() + segments.trailer_length) % 4)) % 4;
+
+	if((segments.trailer_length + pad) > sizeof(segments.trailer))
+		throw(hard_exception("packet: trailer overflow"));
 
-		packet = std::string((const char *)&packet_header, sizeof(packet_header)) + data + pad + oob_data;
+	memset(segments.trailer + segments.trailer_length, 0, pad);
+	segments.trailer_length += pad;
+}
+
+template<typename header_t, bool provide_checksum, bool use_transaction_id> void PacketCodec::encapsulate_header(Packet::Segments &segments,
+		uint32_t transaction_id, unsigned int flags)
+{
+	constexpr bool version_3 = std::is_same<header_t, packet_header_3_t>::value;
+	header_t header = {};
+	struct iovec iov[Packet::segments_max];
+	unsigned int iov_count;
+
+	header.soh = packet_header_soh;
+	header.version = version_3 ? packet_header_version_3 : packet_header_version;
+	header.id = packet_header_id;
+	header.length = sizeof(header) + segments.data.length() + segments.trailer_length + segments.oob_data.length();
+	header.data_offset = sizeof(header);
+	header.data_pad_offset = sizeof(header) + segments.data.length();
+	header.oob_data_offset = sizeof(header) + segments.data.length() + segments.trailer_length;
+	header.broadcast_groups = broadcast_group_mask & ((1 << (sizeof(header.broadcast_groups) * 8)) - 1);
+
+	if constexpr(use_transaction_id)
+	{
+		header.flag.transaction_id_provided = 1;
+		header.transaction_id = transaction_id;
 	}
 
-	return(packet);
+	// old firmware ignores these, new firmware may reply to a version 2 packet with a version 3 packet,
+	// version 2 packets always request md5_32, for the case the firmware doesn't know crc32c
+
+	if(version_3_supported)
+		header.flag.version_3_supported = 1;
+
+	if(oob_compression)
+		header.flag.oob_compression_supported = 1;
+
+	if(request_checksum)
+	{
+		if(crc32c)
+			header.flag.crc32c_requested = 1;
+
+		if(!version_3 || !crc32c)
+			header.flag.md5_32_requested = 1;
+	}
+
+	header.flags |= flags;
+
+	memcpy(segments.header, &header, sizeof(header));
+	segments.header_length = sizeof(header);
+
+	if constexpr(provide_checksum)
+	{
+		if(version_3 && crc32c)
+			header.flag.crc32c_provided = 1;
+		else
+			header.flag.md5_32_provided = 1;
+
+		memcpy(segments.header, &header, sizeof(header));
+		iov_count = segments.gather(iov);
+
+		if(version_3 && crc32c)
+			header.checksum = Packet::CRC32C(iov, iov_count);
+		else
+			header.checksum = Packet::MD5_trunc_32(hash_ctx, iov, iov_count);
+
+		memcpy(segments.header, &header, sizeof(header));
+	}
 }
 
 bool Packet::decapsulate(std::string *data_in, std::string *oob_data_in, bool verbose, bool *rawptr, const uint32_t *transaction_id)
+{
+	std::string_view data_view, oob_data_view;
+
+	if(!decapsulate(data, data_view, oob_data_view, verbose, rawptr, transaction_id))
+		return(false);
+
+	if(data_in)
+		data_in->assign(data_view);
+
+	if(oob_data_in)
+		oob_data_in->assign(oob_data_view);
+
+	return(true);
+}
+
+// the packet isn't copied, data_out and oob_data_out are views into it
+// hash_ctx: reused for the md5_32 checksum if set, see PacketCodec::decapsulate, otherwise one is made for this packet
+
+bool Packet::decapsulate(std::string_view packet, std::string_view &data_out, std::string_view &oob_data_out, bool verbose, bool *rawptr,
+		const uint32_t *transaction_id, EVP_MD_CTX *hash_ctx)
 {
 	bool raw = false;
 	unsigned int our_checksum;
 
-	if(data.length() < sizeof(packet_header))
+	data_out = std::string_view();
+	oob_data_out = std::string_view();
+
+	if(packet.length() < sizeof(packet_header_t))
 		raw = true;
 	else
 	{
-		packet_header = *(packet_header_t *)data.data();
+		const packet_header_t *packet_header_2 = (const packet_header_t *)packet.data();
 
-		if((packet_header.soh != packet_header_soh) || (packet_header.id != packet_header_id))
+		if((packet_header_2->soh != packet_header_soh) || (packet_header_2->id != packet_header_id))
 			raw = true;
 	}
 
@@ -158,10 +438,13 @@ bool Packet::decapsulate(std::string *data_in, std::string *oob_data_in, bool ve
 
 		clear_packet_header();
 
-		padding_offset = data.find('\0', 0);
+		if(raw_end(packet) == packet.length())
+			packet.remove_suffix(packet_raw_end_size);
 
-		if(padding_offset == std::string::npos)
-			oob_data.clear();
+		padding_offset = packet.find('\0', 0);
+
+		if(padding_offset == std::string_view::npos)
+			data_out = packet;
 		else
 		{
 			oob_data_offset = padding_offset + 1;
@@ -169,48 +452,105 @@ bool Packet::decapsulate(std::string *data_in, std::string *oob_data_in, bool ve
 			while((oob_data_offset % 4) != 0)
 				oob_data_offset++;
 
-			if(oob_data_offset < data.length())
-				oob_data = data.substr(oob_data_offset);
+			if(oob_data_offset < packet.length())
+				oob_data_out = packet.substr(oob_data_offset);
 			else
 			{
 				if(verbose)
 					std::cout << "invalid raw oob data padding" << std::endl;
-
-				oob_data.clear();
 			}
 
-			data.erase(padding_offset);
+			data_out = packet.substr(0, padding_offset);
 		}
 	}
 	else
 	{
-		packet_header = *(packet_header_t *)data.data();
+		const packet_header_t *packet_header_2 = (const packet_header_t *)packet.data();
+		struct iovec iov[2];
 
-		if(packet_header.version != packet_header_version)
-		{
-			if(verbose)
-				std::cout << boost::format("decapsulate: wrong version packet received: %u") % packet_header.version << std::endl;
+		// the checksum is calculated over the header with the checksum field cleared and the
+		// remainder of the packet as received, the latter is not copied
 
-			return(false);
-		}
+		iov[1].iov_base = const_cast<char *>(packet.data() + sizeof(packet_header_t));
+		iov[1].iov_len = packet.length() - sizeof(packet_header_t);
 
-		if(packet_header.flag.md5_32_provided)
+		if(packet_header_2->version == packet_header_version)
 		{
-			packet_header_t packet_header_checksum = packet_header;
-			std::string data_checksum;
+			if(packet_header_2->flag.md5_32_provided)
+			{
+				packet_header_t packet_header_checksum = *packet_header_2;
+
+				packet_header_checksum.checksum = 0;
+				iov[0].iov_base = &packet_header_checksum;
+				iov[0].iov_len = sizeof(packet_header_checksum);
+				our_checksum = hash_ctx ? MD5_trunc_32(hash_ctx, iov, 2) : MD5_trunc_32(iov, 2);
 
-			packet_header_checksum.checksum = 0;
-			data_checksum = std::string((const char *)&packet_header_checksum, sizeof(packet_header_checksum)) + data.substr(packet_header.data_offset);
-			our_checksum = MD5_trunc_32(data_checksum);
+				if(our_checksum != packet_header_2->checksum)
+				{
+					if(verbose)
+						std::cout << boost::format("decapsulate: invalid checksum, ours: 0x%x, theirs: 0x%x") % our_checksum % (unsigned int)packet_header_2->checksum << std::endl;
+
+					return(false);
+				}
+			}
+
+			packet_header.soh = packet_header_2->soh;
+			packet_header.version = packet_header_2->version;
+			packet_header.id = packet_header_2->id;
+			packet_header.flags = packet_header_2->flags;
+			packet_header.broadcast_groups = packet_header_2->broadcast_groups;
+			packet_header.length = packet_header_2->length;
+			packet_header.data_offset = packet_header_2->data_offset;
+			packet_header.data_pad_offset = packet_header_2->data_pad_offset;
+			packet_header.oob_data_offset = packet_header_2->oob_data_offset;
+			packet_header.transaction_id = packet_header_2->transaction_id;
+			packet_header.checksum = packet_header_2->checksum;
+		}
+		else if(packet_header_2->version == packet_header_version_3)
+		{
+			packet_header = *(const packet_header_3_t *)packet.data();
 
-			if(our_checksum != packet_header.checksum)
+			if(packet_header.flag.crc32c_provided || packet_header.flag.md5_32_provided)
 			{
-				if(verbose)
-					std::cout << boost::format("decapsulate: invalid checksum, ours: 0x%x, theirs: 0x%x") % our_checksum % (unsigned int)packet_header.checksum << std::endl;
+				packet_header_3_t packet_header_checksum = packet_header;
+
+				packet_header_checksum.checksum = 0;
+				iov[0].iov_base = &packet_header_checksum;
+				iov[0].iov_len = sizeof(packet_header_checksum);
+
+				if(packet_header.flag.crc32c_provided)
+					our_checksum = CRC32C(iov, 2);
+				else
+					our_checksum = hash_ctx ? MD5_trunc_32(hash_ctx, iov, 2) : MD5_trunc_32(iov, 2);
+
+				if(our_checksum != packet_header.checksum)
+				{
+					if(verbose)
+						std::cout << boost::format("decapsulate: invalid %s checksum, ours: 0x%x, theirs: 0x%x") %
+								(packet_header.flag.crc32c_provided ? "crc32c" : "md5_32") % our_checksum % (unsigned int)packet_header.checksum << std::endl;
 
-				return(false);
+					return(false);
+				}
 			}
 		}
+		else
+		{
+			if(verbose)
+				std::cout << boost::format("decapsulate: wrong version packet received: %u") % (unsigned int)packet_header_2->version << std::endl;
+
+			return(false);
+		}
+
+		if((packet_header.data_offset > packet_header.data_pad_offset) || (packet_header.data_pad_offset > packet.length()) ||
+				(packet_header.oob_data_offset > packet.length()))
+		{
+			if(verbose)
+				std::cout << boost::format("decapsulate: invalid offsets, data: %u, padding: %u, oob data: %u, length: %u") %
+						(unsigned int)packet_header.data_offset % (unsigned int)packet_header.data_pad_offset %
+						(unsigned int)packet_header.oob_data_offset % packet.length() << std::endl;
+
+			return(false);
+		}
 
 		if(transaction_id && packet_header.flag.transaction_id_provided && (packet_header.transaction_id != *transaction_id))
 		{
@@ -223,26 +563,36 @@ bool Packet::decapsulate(std::string *data_in, std::string *oob_data_in, bool ve
 		{
 			if(verbose)
 				std::cout << boost::format("packet oob data padding invalid: %u") % (unsigned int)packet_header.oob_data_offset << std::endl;
-			oob_data.clear();
+
+			data_out = packet;
 		}
 		else
 		{
-			oob_data = data.substr(packet_header.oob_data_offset);
-			data = data.substr(packet_header.data_offset, packet_header.data_pad_offset - packet_header.data_offset);
-		}
-	}
+			oob_data_out = packet.substr(packet_header.oob_data_offset);
+			data_out = packet.substr(packet_header.data_offset, packet_header.data_pad_offset - packet_header.data_offset);
 
-	if((data.back() == '\n') || (data.back() == '\r'))
-		data.pop_back();
+			// the only case where the oob data is copied, into this packet
 
-	if((data.back() == '\n') || (data.back() == '\r'))
-		data.pop_back();
+			if(packet_header.flag.oob_compressed && !oob_data_out.empty())
+			{
+				if(!Lzss::decompress(oob_data_out, oob_data, oob_decompressed_max))
+				{
+					if(verbose)
+						std::cout << "decapsulate: invalid compressed oob data" << std::endl;
 
-	if(data_in)
-		*data_in = data;
+					return(false);
+				}
 
-	if(oob_data_in)
-		*oob_data_in = oob_data;
+				oob_data_out = oob_data;
+			}
+		}
+	}
+
+	if(!data_out.empty() && ((data_out.back() == '\n') || (data_out.back() == '\r')))
+		data_out.remove_suffix(1);
+
+	if(!data_out.empty() && ((data_out.back() == '\n') || (data_out.back() == '\r')))
+		data_out.remove_suffix(1);
 
 	if(rawptr)
 		*rawptr = raw;
@@ -250,21 +600,66 @@ bool Packet::decapsulate(std::string *data_in, std::string *oob_data_in, bool ve
 	return(true);
 }
 
-bool Packet::complete()
+// length of the first complete message at the start of a tcp byte stream, 0 if it needs more data
+// framed: packet_header length
+// raw: up to and including the end marker, see packet_raw_end in ota.h, without it
+// a reply can have any number of lines and oob data without length, so the message is all of it,
+// once the stream has gone quiet
+
+size_t Packet::stream_length(std::string_view stream, bool quiet, bool &framed) noexcept
 {
-	if(data.length() == 0)
-		return(false);
+	packet_header_t packet_header_2;
+	uint32_t length;
+
+	framed = false;
+
+	if(stream.length() == 0)
+		return(0);
+
+	if((stream[0] == packet_header_soh) && ((stream.length() < sizeof(packet_header_t)) ||
+			(((const packet_header_t *)stream.data())->id == packet_header_id)))
+	{
+		framed = true;
 
-	if(data.length() < sizeof(packet_header))
-		return(data.back() == '\n');
+		if(stream.length() < sizeof(packet_header_t))
+			return(0);
 
-	packet_header = *(packet_header_t *)data.data();
+		memcpy(&packet_header_2, stream.data(), sizeof(packet_header_2));
 
-	if((packet_header.soh == packet_header_soh) &&
-			(packet_header.id == packet_header_id))
+		if(packet_header_2.version == packet_header_version_3)
+			length = ((const packet_header_3_t *)stream.data())->length;
+		else
+			length = packet_header_2.length;
+
+		// garbage, hand it all to decapsulate, which will reject it
+
+		if(length < sizeof(packet_header_t))
+			return(stream.length());
+
+		return((stream.length() >= length) ? length : 0);
+	}
+
+	if((length = raw_end(stream)) > 0)
+		return(length);
+
+	return(quiet ? stream.length() : 0);
+}
+
+// length of the first raw reply in the stream that has an end marker, including the marker, 0 if none
+
+size_t Packet::raw_end(std::string_view stream) noexcept
+{
+	size_t offset;
+	uint32_t length;
+
+	for(offset = stream.find((char)packet_raw_end); (offset != std::string_view::npos) && ((offset + packet_raw_end_size) <= stream.length());
+			offset = stream.find((char)packet_raw_end, offset + 1))
 	{
-		return(data.length() >= packet_header.length);
+		memcpy(&length, stream.data() + offset + 1, sizeof(length));
+
+		if(length == offset)
+			return(offset + packet_raw_end_size);
 	}
 
-	return((data.length() < 1460 /* tcp mss initial segment */) || (data.length() > 4096));
+	return(0);
 }
@@ -1,5 +1,12 @@
+#ifndef _packet_h_
+#define _packet_h_
+
 #include <string>
+#include <string_view>
+#include <vector>
 #include <stdint.h>
+#include <sys/uio.h>
+#include <openssl/evp.h>
 
 // for packet_header_t
 extern "C" {
@@ -17,25 +24,105 @@ class Packet
 {
 	friend class Espif;
 	friend class Util;
+	friend class PacketCodec;
+	friend class GenericSocket;
+	friend class Fleet;
 
 	protected:
 
+		enum { segments_max = 4 };
+
+		// header, data, padding and oob data, the data and oob data are referenced, not copied
+
+		struct Segments
+		{
+			char header[sizeof(packet_header_3_t)];
+			unsigned int header_length;
+			std::string_view data;
+			char trailer[8];
+			unsigned int trailer_length;
+			std::string_view oob_data;
+
+			unsigned int gather(struct iovec *iov) const noexcept;
+			size_t length() const noexcept;
+		};
+
 		Packet(Packet &) = delete;
 		Packet();
 		Packet(const std::string &data, const std::string &oob_data = "");
 		void clear();
 		void append_data(const std::string &);
 		void append_oob_data(const std::string &);
-		std::string encapsulate(bool raw, bool provide_checksum, bool request_checksum, unsigned int broadcast_group_mask, const uint32_t *transaction_id = nullptr);
+		std::string encapsulate(bool raw, bool provide_checksum, bool request_checksum, unsigned int broadcast_group_mask, const uint32_t *transaction_id = nullptr,
+				unsigned int version = packet_header_version, bool version_3_supported = false, bool crc32c = false);
 		bool decapsulate(std::string *data, std::string *oob_data, bool verbose, bool *raw = nullptr, const uint32_t *transaction_id = nullptr);
-		bool complete();
+		bool decapsulate(std::string_view packet, std::string_view &data, std::string_view &oob_data, bool verbose, bool *raw = nullptr,
+				const uint32_t *transaction_id = nullptr, EVP_MD_CTX *hash_ctx = nullptr);
+		static size_t stream_length(std::string_view stream, bool quiet, bool &framed) noexcept;
+		static size_t raw_end(std::string_view stream) noexcept;
 
 	private:
 
+		enum { oob_decompressed_max = 1024 * 1024 };
+
 		std::string data;
 		std::string oob_data;
-		packet_header_t packet_header;
+		packet_header_3_t packet_header;
 
 		void clear_packet_header() noexcept;
-		static uint32_t MD5_trunc_32(const std::string &data) noexcept;
+		static uint32_t MD5_trunc_32(const struct iovec *iov, unsigned int iov_count) noexcept;
+		static uint32_t MD5_trunc_32(EVP_MD_CTX *hash_ctx, const struct iovec *iov, unsigned int iov_count) noexcept;
+		static uint32_t CRC32C(const struct iovec *iov, unsigned int iov_count) noexcept;
+};
+
+// packet encoder for a session, the raw, checksum and transaction id choices are fixed at construction
+// and select a specialised encoder, the negotiated version can still change,
+// the md5 context is shared by encoding and decoding, both start it afresh
+
+class PacketCodec
+{
+	friend class Espif;
+	friend class Util;
+	friend class Packet;
+	friend class Fleet;
+
+	protected:
+
+		struct Request
+		{
+			std::string_view data;
+			std::string_view oob_data;
+			uint32_t transaction_id;
+			unsigned int flags;
+		};
+
+		PacketCodec(const PacketCodec &) = delete;
+		PacketCodec(bool raw, bool provide_checksum, bool request_checksum, unsigned int broadcast_group_mask, bool transaction_id,
+				bool version_3_supported = false, bool crc32c = false, bool oob_compression = false) noexcept;
+		~PacketCodec() noexcept;
+		void set_version(unsigned int version) noexcept;
+		void encapsulate(Packet::Segments &segments, std::string_view data, std::string_view oob_data, uint32_t transaction_id = 0, unsigned int flags = 0);
+		void encapsulate(const std::vector<Request> &requests, std::vector<Packet::Segments> &segments);
+		bool decapsulate(Packet &packet, std::string_view message, std::string_view &data, std::string_view &oob_data, bool verbose, bool *raw = nullptr,
+				const uint32_t *transaction_id = nullptr);
+
+	private:
+
+		typedef void (PacketCodec::*encapsulator_t)(Packet::Segments &, std::string_view, std::string_view, uint32_t, unsigned int);
+
+		encapsulator_t encapsulator;
+		EVP_MD_CTX *hash_ctx;
+		bool request_checksum;
+		unsigned int broadcast_group_mask;
+		unsigned int version;
+		bool version_3_supported;
+		bool crc32c;
+		bool oob_compression;
+
+		static void encapsulate_pad(Packet::Segments &segments);
+		template<bool framed, bool provide_checksum, bool use_transaction_id> void encapsulate_policy(Packet::Segments &segments,
+				std::string_view data, std::string_view oob_data, uint32_t transaction_id, unsigned int flags);
+		template<typename header_t, bool provide_checksum, bool use_transaction_id> void encapsulate_header(Packet::Segments &segments,
+				uint32_t transaction_id, unsigned int flags);
 };
+#endif
@@ -1,17 +1,126 @@
 #include "util.h"
 #include "packet.h"
 #include "exception.h"
+#include "host_cache.h"
+#include "lzss.h"
 
 #include <string>
+#include <map>
 #include <iostream>
+#include <time.h>
+#include <stdlib.h>
 #include <boost/format.hpp>
 #include <boost/regex.hpp>
 
 Util::Util(GenericSocket &channel_in, const EspifConfig &config_in) noexcept
 	:
 		channel(channel_in),
-		config(config_in)
+		config(config_in),
+		codec(config_in.raw, config_in.provide_checksum, config_in.request_checksum, config_in.broadcast_group_mask, true,
+				config_in.packet_version >= packet_header_version_3, config_in.crc32c, config_in.oob_compression)
 {
+	next_transaction_id = (uint32_t)time_usec();
+	reset_negotiation();
+}
+
+Util::~Util() noexcept
+{
+}
+
+uint64_t Util::time_usec() noexcept
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return(((uint64_t)ts.tv_sec * 1000000ULL) + ((uint64_t)ts.tv_nsec / 1000ULL));
+}
+
+uint32_t Util::new_transaction_id() const noexcept
+{
+	return(next_transaction_id++);
+}
+
+// forget everything learned about the firmware, after a reset it may be another firmware
+
+void Util::reset_negotiation() const noexcept
+{
+	negotiated_transfer_sectors = 0;
+	negotiated_payload_size = 0;
+	negotiated_oob_compression = false;
+	negotiated_packet_version = packet_header_version;
+	multi_command_state = multi_command_unknown;
+	checksum_list_state = checksum_list_unknown;
+	codec.set_version(negotiated_packet_version);
+}
+
+void Util::negotiate_packet_version(unsigned int version) const
+{
+	if((version != packet_header_version_3) || (negotiated_packet_version == packet_header_version_3) ||
+			(config.packet_version < packet_header_version_3))
+		return;
+
+	negotiated_packet_version = packet_header_version_3;
+	codec.set_version(negotiated_packet_version);
+
+	if(config.verbose)
+		std::cout << boost::format("packet version 3 negotiated, checksum: %s") % (config.crc32c ? "crc32c" : "md5_32") << std::endl;
+}
+
+// firmware that can decompress oob data says so in every reply, see oob_compression_supported in ota.h
+
+void Util::negotiate_oob_compression(bool supported) const
+{
+	if(!supported || negotiated_oob_compression || !config.oob_compression || config.raw)
+		return;
+
+	negotiated_oob_compression = true;
+
+	if(config.verbose)
+		std::cout << "oob compression negotiated" << std::endl;
+}
+
+bool Util::oob_compression() const noexcept
+{
+	return(negotiated_oob_compression);
+}
+
+static void capture_values(const boost::smatch &capture, std::vector<std::string> *string_value, std::vector<int> *int_value)
+{
+	unsigned int captures;
+
+	if(string_value)
+		string_value->clear();
+
+	if(int_value)
+		int_value->clear();
+
+	captures = 0;
+
+	for(const auto &it : capture)
+	{
+		if(captures++ == 0)
+			continue;
+
+		if(string_value)
+			string_value->push_back(it);
+
+		if(int_value)
+		{
+			try
+			{
+				int_value->push_back(stoi(it, 0, 0));
+			}
+			catch(std::invalid_argument &)
+			{
+				int_value->push_back(0);
+			}
+			catch(std::out_of_range &)
+			{
+				int_value->push_back(0);
+			}
+		}
+	}
 }
 
 std::string Util::dumper(const char *id, const std::string text)
@@ -48,65 +157,108 @@ std::string Util::sha1_hash_to_text(unsigned int length, const unsigned char *ha
 	return(hash_string);
 }
 
-int Util::process(const std::string &data, const std::string &oob_data, std::string &reply_data, std::string *reply_oob_data,
+int Util::process(const std::string &data, std::string_view oob_data, std::string &reply_data, std::string *reply_oob_data,
 		const char *match, std::vector<std::string> *string_value, std::vector<int> *int_value) const
+{
+	Packet reply_packet;
+	std::string_view reply_oob_data_view;
+	int retries;
+
+	retries = process(data, oob_data, reply_packet, reply_data, &reply_oob_data_view, match, string_value, int_value);
+
+	if(reply_oob_data)
+		reply_oob_data->assign(reply_oob_data_view);
+
+	return(retries);
+}
+
+// the reply oob data is a view into the channel's receive buffer, valid until the next receive
+
+int Util::process(const std::string &data, std::string_view oob_data, Packet &receive_packet, std::string &reply_data, std::string_view *reply_oob_data,
+		const char *match, std::vector<std::string> *string_value, std::vector<int> *int_value, unsigned int flags) const
 {
 	enum { max_attempts = 8 };
 	unsigned int attempt;
-	Packet send_packet(data, oob_data);
-	std::string send_data;
-	std::string packet;
-	Packet receive_packet;
-	std::string receive_data;
+	Packet::Segments segments;
+	struct iovec iov[Packet::segments_max];
+	unsigned int iov_count;
+	std::string_view message;
+	std::string_view reply_data_view;
+	std::string_view reply_oob_data_view;
 	boost::smatch capture;
 	boost::regex re(match ? match : "");
-	unsigned int captures;
-	int timeout;
+	uint32_t transaction_id;
+	uint64_t start;
+	bool raw;
 
 	if(config.debug)
 		std::cout << std::endl << Util::dumper("data", data) << std::endl;
 
-	packet = send_packet.encapsulate(config.raw, config.provide_checksum, config.request_checksum, config.broadcast_group_mask);
-
-	timeout = 100;
+	transaction_id = new_transaction_id();
+	codec.encapsulate(segments, data, oob_data, transaction_id, flags);
+	iov_count = segments.gather(iov);
 
 	for(attempt = 0; attempt < max_attempts; attempt++)
 	{
 		try
 		{
-			send_data = packet;
-
-			while(send_data.length() > 0)
-				if(!channel.send(send_data))
-					throw(transient_exception("send failed"));
+			if(!channel.send(iov, iov_count))
+				throw(transient_exception("send failed"));
 
-			receive_packet.clear();
+			start = time_usec();
 
-			while(!receive_packet.complete())
+			for(;;)
 			{
-				receive_data.clear();
-
-				if(!channel.receive(receive_data))
+				if(!channel.receive_message(message, channel.rto()))
 					throw(transient_exception("receive failed"));
 
-				receive_packet.append_data(receive_data);
-			}
+				if(!codec.decapsulate(receive_packet, message, reply_data_view, reply_oob_data_view, config.verbose, &raw))
+					throw(transient_exception("decapsulation failed"));
 
-			if(!receive_packet.decapsulate(&reply_data, reply_oob_data, config.verbose))
-				throw(transient_exception("decapsulation failed"));
+				reply_data.assign(reply_data_view);
+
+				if(raw || !receive_packet.packet_header.flag.transaction_id_provided ||
+						(receive_packet.packet_header.transaction_id == transaction_id))
+				{
+					if(!raw)
+					{
+						negotiate_packet_version(receive_packet.packet_header.version);
+						negotiate_oob_compression(receive_packet.packet_header.flag.oob_compression_supported);
+					}
+
+					break;
+				}
+
+				if(config.verbose)
+					std::cout << boost::format("process: dropping stale reply, transaction id 0x%08x vs. 0x%08x") %
+							(unsigned int)receive_packet.packet_header.transaction_id % transaction_id << std::endl;
+			}
 
 			if(match && !boost::regex_match(reply_data, capture, re))
 				throw(transient_exception(boost::format("received string does not match: \"%s\" vs. \"%s\"") % Util::dumper("reply", reply_data) % match));
 
+			// Karn: only replies to the first transmission give an unambiguous rtt sample
+
+			if(attempt == 0)
+				channel.rtt_update(time_usec() - start);
+
+			channel.pacing_success();
+
 			break;
 		}
 		catch(const transient_exception &e)
 		{
+			channel.rto_backoff();
+			channel.pacing_loss();
+
 			if(config.verbose)
-				std::cout << boost::format("process attempt #%u failed: %s, backoff %u ms") % attempt % e.what() % timeout << std::endl;
+				std::cout << boost::format("process attempt #%u failed: %s, %s") % attempt % e.what() % channel.rtt_text() << std::endl;
+
+			// with a transaction id on every request, stale replies are recognised and dropped
+			// by the receive loop above, only raw sessions still need to be drained
 
-			channel.drain(timeout);
-			timeout *= 2;
+			if(config.raw)
+				channel.drain(channel.rto());
 
 			continue;
 		}
@@ -119,50 +271,318 @@ int Util::process(const std::string &data, const std::string &oob_data, std::str
 		throw(transient_exception("process: no more attempts"));
 
 	if(string_value || int_value)
+		capture_values(capture, string_value, int_value);
+
+	if(reply_oob_data)
+		*reply_oob_data = reply_oob_data_view;
+
+	if(config.debug)
+		std::cout << std::endl << Util::dumper("reply", reply_data) << std::endl;
+
+	return(attempt);
+}
+
+// out of line, too large to be inlined everywhere a reply is dropped
+
+Util::CommandReply::~CommandReply() noexcept
+{
+}
+
+// run several commands in as few round trips as possible, see multi_command in ota.h,
+// falls back to one command per round trip for raw sessions and firmware that doesn't support it
+// a lost reply makes the whole packet go again, which runs every command in it again,
+// so commands that aren't idempotent (toggles etc.) should be sent with --no-multi-command
+
+int Util::process_multi(const std::vector<std::string> &commands, std::vector<CommandReply> &replies) const
+{
+	enum { commands_max = 32 };
+	packet_header_3_t header = {};
+	Packet receive_packet;
+	std::string data;
+	std::string reply_data;
+	std::string_view reply_oob_data;
+	const multi_command_reply_t *record;
+	unsigned int next, count, records, limit, offset, length;
+	int retries;
+
+	header.flag.multi_command = 1;
+	replies.clear();
+	retries = 0;
+
+	for(next = 0; next < commands.size(); next += count)
 	{
-		if(string_value)
-			string_value->clear();
+		if(config.raw || !config.multi_command || (multi_command_state == multi_command_unsupported))
+		{
+			retries += process(commands[next], "", receive_packet, reply_data, &reply_oob_data);
+			replies.push_back({ reply_data, std::string(reply_oob_data), multi_command_status_ok });
+			count = 1;
+			continue;
+		}
 
-		if(int_value)
-			int_value->clear();
+		// the first packet has one command only, in case the firmware runs it as a single command,
+		// the others have as many as fit in a sector, the size the firmware surely can receive
 
-		captures = 0;
+		limit = (multi_command_state == multi_command_unknown) ? 1 : commands_max;
+		data = commands[next];
 
-		for(const auto &it : capture)
+		for(count = 1; ((next + count) < commands.size()) && (count < limit) &&
+				((data.length() + 1 + commands[next + count].length()) <= config.sector_size); count++)
 		{
-			if(captures++ == 0)
-				continue;
+			data.append("\n");
+			data.append(commands[next + count]);
+		}
 
-			if(string_value)
-				string_value->push_back(it);
+		retries += process(data, "", receive_packet, reply_data, &reply_oob_data, nullptr, nullptr, nullptr, header.flags);
 
-			if(int_value)
+		if(!receive_packet.packet_header.flag.multi_command)
+		{
+			if(config.verbose)
+				std::cout << "multi command: not supported by firmware" << std::endl;
+
+			// the firmware ran the packet as one command, the reply is for the first one only,
+			// the others go again, one by one
+
+			multi_command_state = multi_command_unsupported;
+			replies.push_back({ reply_data, std::string(reply_oob_data), multi_command_status_ok });
+			count = 1;
+			continue;
+		}
+
+		if((multi_command_state == multi_command_unknown) && config.verbose)
+			std::cout << "multi command: supported by firmware" << std::endl;
+
+		multi_command_state = multi_command_supported;
+
+		// the firmware may have run less commands than sent, if it ran out of reply space, the rest goes in the next packet
+
+		for(offset = 0, records = 0; offset < reply_oob_data.length(); records++)
+		{
+			if((records >= count) || ((offset + sizeof(*record)) > reply_oob_data.length()))
+				throw(hard_exception("multi command: invalid reply"));
+
+			record = (const multi_command_reply_t *)(reply_oob_data.data() + offset);
+			length = sizeof(*record) + record->length + record->oob_length;
+
+			if((offset + length) > reply_oob_data.length())
+				throw(hard_exception("multi command: invalid reply record"));
+
+			replies.push_back({ std::string(reply_oob_data.substr(offset + sizeof(*record), record->length)),
+					std::string(reply_oob_data.substr(offset + sizeof(*record) + record->length, record->oob_length)), record->status });
+
+			offset += (length + 3) & ~3U;
+		}
+
+		if(records == 0)
+			throw(hard_exception("multi command: no commands run"));
+
+		if(config.verbose)
+			std::cout << boost::format("multi command: sent %u commands, %u run") % count % records << std::endl;
+
+		count = records;
+	}
+
+	return(retries);
+}
+
+int Util::process_window(std::vector<Transaction> &transactions, const char *match) const
+{
+	enum { max_attempts = 8 };
+	std::vector<PacketCodec::Request> requests(transactions.size());
+	std::vector<Packet::Segments> packets;
+	std::vector<unsigned int> attempts(transactions.size(), 0);
+	std::vector<uint64_t> sent(transactions.size(), 0);
+	std::vector<uint64_t> deadline(transactions.size(), 0);
+	std::vector<bool> rejected(transactions.size(), false);
+	std::map<uint32_t, unsigned int> in_flight;
+	std::map<uint32_t, unsigned int>::iterator it;
+	unsigned int next, finished, index;
+	Packet receive_packet;
+	struct iovec iov[Packet::segments_max];
+	unsigned int iov_count;
+	std::string reply_data;
+	std::string_view message;
+	std::string_view reply_data_view;
+	std::string_view reply_oob_data_view;
+	boost::smatch capture;
+	boost::regex re(match);
+	uint64_t now;
+	int timeout;
+	int retries;
+	bool idle;
+
+	next = finished = 0;
+	retries = 0;
+	idle = false;
+
+	// without transaction ids (raw) replies can't be matched, run one by one
+
+	if((config.window < 2) || config.raw)
+	{
+		for(auto &transaction : transactions)
+		{
+			retries += process(transaction.data, transaction.oob_data, receive_packet, transaction.reply_data, &reply_oob_data_view,
+					match, nullptr, &transaction.int_value, transaction.flags);
+
+			transaction.reply_oob_length = reply_oob_data_view.length();
+
+			if(transaction.reply_oob_buffer)
+				reply_oob_data_view.copy(transaction.reply_oob_buffer, transaction.reply_oob_buffer_size);
+			else
+				transaction.reply_oob_data.assign(reply_oob_data_view);
+		}
+
+		return(retries);
+	}
+
+	for(index = 0; index < transactions.size(); index++)
+		requests[index] = { .data = transactions[index].data, .oob_data = transactions[index].oob_data, .transaction_id = new_transaction_id(),
+				.flags = transactions[index].flags };
+
+	codec.encapsulate(requests, packets);
+
+	while(finished < transactions.size())
+	{
+		while((in_flight.size() < config.window) && (next < transactions.size()))
+		{
+			in_flight[requests[next].transaction_id] = next;
+			next++;
+		}
+
+		now = time_usec();
+		timeout = channel.rto();
+
+		// expired entries are only retransmitted once the socket has no more replies queued,
+		// otherwise time spent in pacing would make replies that already arrived look lost
+
+		for(const auto &flight : in_flight)
+		{
+			index = flight.second;
+
+			if((deadline[index] == 0) || (idle && (now >= deadline[index])))
 			{
-				try
+				if(deadline[index] != 0)
 				{
-					int_value->push_back(stoi(it, 0, 0));
-				}
-				catch(std::invalid_argument &)
-				{
-					int_value->push_back(0);
-				}
-				catch(std::out_of_range &)
-				{
-					int_value->push_back(0);
+					if(++attempts[index] >= max_attempts)
+						throw(transient_exception(boost::format("process window: no more attempts for \"%s\"") % transactions[index].data));
+
+					// tcp doesn't lose replies, a late one is queued behind the others, just wait longer
+
+					if(config.use_tcp)
+					{
+						deadline[index] = now + ((channel.rto() * 1000ULL) << attempts[index]);
+						continue;
+					}
+
+					channel.pacing_loss();
+
+					if(config.verbose)
+						std::cout << boost::format("process window: retransmit \"%s\", attempt #%u, %s") % Util::dumper("data", transactions[index].data) % attempts[index] % channel.rtt_text() << std::endl;
+
+					retries++;
 				}
+
+				if(config.debug)
+					std::cout << std::endl << Util::dumper("data", transactions[index].data) << std::endl;
+
+				iov_count = packets[index].gather(iov);
+				channel.send(iov, iov_count);
+
+				// the session rto only follows the rtt samples here, backing it off for every
+				// timed out entry would inflate it for all other entries in flight as well
+
+				now = time_usec();
+				sent[index] = now;
+				deadline[index] = now + ((channel.rto() * 1000ULL) << attempts[index]);
+				rejected[index] = false;
 			}
+
+			if(deadline[index] <= now)
+				timeout = 0;
+			else
+				if(((deadline[index] - now + 999) / 1000) < (uint64_t)timeout)
+					timeout = (deadline[index] - now + 999) / 1000;
+		}
+
+		idle = false;
+
+		if(!channel.receive_message(message, timeout))
+		{
+			idle = true;
+			continue;
+		}
+
+		if(!codec.decapsulate(receive_packet, message, reply_data_view, reply_oob_data_view, config.verbose))
+			continue;
+
+		reply_data.assign(reply_data_view);
+
+		if(!receive_packet.packet_header.flag.transaction_id_provided ||
+				((it = in_flight.find(receive_packet.packet_header.transaction_id)) == in_flight.end()))
+		{
+			if(config.verbose)
+				std::cout << "process window: dropping stale reply" << std::endl;
+
+			continue;
 		}
+
+		index = it->second;
+		negotiate_packet_version(receive_packet.packet_header.version);
+		negotiate_oob_compression(receive_packet.packet_header.flag.oob_compression_supported);
+
+		if(!boost::regex_match(reply_data, capture, re))
+		{
+			if(config.verbose)
+				std::cout << boost::format("process window: received string does not match: \"%s\" vs. \"%s\"") % Util::dumper("reply", reply_data) % match << std::endl;
+
+			deadline[index] = now;
+			rejected[index] = true;
+			continue;
+		}
+
+		if(config.debug)
+			std::cout << std::endl << Util::dumper("reply", reply_data) << std::endl;
+
+		if(attempts[index] == 0)
+			channel.rtt_update(time_usec() - sent[index]);
+
+		channel.pacing_success();
+
+		capture_values(capture, nullptr, &transactions[index].int_value);
+		transactions[index].reply_data = reply_data;
+		transactions[index].reply_oob_length = reply_oob_data_view.length();
+
+		if(transactions[index].reply_oob_buffer)
+			reply_oob_data_view.copy(transactions[index].reply_oob_buffer, transactions[index].reply_oob_buffer_size);
+		else
+			transactions[index].reply_oob_data.assign(reply_oob_data_view);
+
+		in_flight.erase(it);
+		finished++;
+
+		// the device handles one packet at a time, the entries after this one were queued behind it,
+		// so their timers restart at every reply, like tcp restarts its retransmit timer on every ack,
+		// otherwise a device that takes longer to flash a packet than the rtt gets needless retransmits
+
+		now = time_usec();
+
+		for(const auto &flight : in_flight)
+			if((deadline[flight.second] != 0) && !rejected[flight.second])
+				deadline[flight.second] = std::max(deadline[flight.second], (uint64_t)(now + ((channel.rto() * 1000ULL) << attempts[flight.second])));
 	}
 
-	if(config.debug)
-		std::cout << std::endl << Util::dumper("reply", reply_data) << std::endl;
+	if(config.verbose && (retries > 0))
+		std::cout << boost::format("process window: %u transactions, %u retransmits") % transactions.size() % retries << std::endl;
 
-	return(attempt);
+	return(retries);
 }
 
-int Util::read_sector(unsigned int sector_size, unsigned int sector, std::string &data) const
+// the sector is copied straight from the receive buffer to data, which must hold sector_size bytes
+
+int Util::read_sector(unsigned int sector_size, unsigned int sector, char *data) const
 {
+	Packet reply_packet;
 	std::string reply;
+	std::string_view reply_oob_data;
 	std::vector<int> int_value;
 	std::vector<std::string> string_value;
 	int retries;
@@ -170,7 +590,7 @@ int Util::read_sector(unsigned int sector_size, unsigned int sector, std::string
 	try
 	{
 		retries = process((boost::format("flash-read %u\n") % sector).str(), "",
-				reply, &data, "OK flash-read: read sector ([0-9]+)", &string_value, &int_value);
+				reply_packet, reply, &reply_oob_data, "OK flash-read: read sector ([0-9]+)", &string_value, &int_value);
 	}
 	catch(const hard_exception &e)
 	{
@@ -181,13 +601,13 @@ int Util::read_sector(unsigned int sector_size, unsigned int sector, std::string
 		throw(transient_exception(boost::format("read sector: transient exception: %s") % e.what()));
 	}
 
-	if(data.length() < sector_size)
+	if(reply_oob_data.length() < sector_size)
 	{
 		if(config.verbose)
 			std::cout << boost::format("flash sector read failed: incorrect length, expected: %u, received: %u, reply: %s") %
-					sector_size % data.length() % reply << std::endl;
+					sector_size % reply_oob_data.length() % reply << std::endl;
 
-		throw(transient_exception(boost::format("read_sector failed: incorrect length (%u vs. %u)") % sector_size % data.length()));
+		throw(transient_exception(boost::format("read_sector failed: incorrect length (%u vs. %u)") % sector_size % reply_oob_data.length()));
 	}
 
 	if(int_value[0] != (int)sector)
@@ -198,27 +618,303 @@ int Util::read_sector(unsigned int sector_size, unsigned int sector, std::string
 		throw(transient_exception(boost::format("read sector failed: incorrect sector (%u vs. %u)") % sector % int_value[0]));
 	}
 
+	reply_oob_data.copy(data, sector_size);
+
 	return(retries);
 }
 
+// one exchange with a payload of length bytes, to or from the device, unlike process() there are only
+// two tries and no rto backoff, a payload that's too large for the device or the path is expected to fail
+
+bool Util::probe_payload(unsigned int length, bool receive) const
+{
+	enum { tries = 2 };
+	std::string data, oob_data, expect;
+	Packet receive_packet;
+	Packet::Segments segments;
+	struct iovec iov[Packet::segments_max];
+	unsigned int iov_count, attempt;
+	std::string_view message, reply_data, reply_oob_data;
+	uint32_t transaction_id;
+	bool raw;
+
+	if(receive)
+	{
+		data = (boost::format("flash-bench %u") % length).str();
+		expect = (boost::format("OK flash-bench: sending %u bytes") % length).str();
+	}
+	else
+	{
+		data = "flash-bench 0";
+		oob_data.assign(length, 0xff);
+		expect = "OK flash-bench: sending 0 bytes";
+	}
+
+	transaction_id = new_transaction_id();
+	codec.encapsulate(segments, data, oob_data, transaction_id);
+	iov_count = segments.gather(iov);
+
+	for(attempt = 0; attempt < tries; attempt++)
+	{
+		if(!channel.send(iov, iov_count))
+			continue;
+
+		while(channel.receive_message(message, channel.rto() * 2))
+		{
+			if(!codec.decapsulate(receive_packet, message, reply_data, reply_oob_data, config.verbose, &raw))
+				break;
+
+			// late replies to a previous (smaller) probe
+
+			if(!raw && receive_packet.packet_header.flag.transaction_id_provided &&
+					(receive_packet.packet_header.transaction_id != transaction_id))
+				continue;
+
+			if((reply_data == expect) && (!receive || (reply_oob_data.length() == length)))
+				return(true);
+
+			break;
+		}
+	}
+
+	return(false);
+}
+
+// the largest payload, doubling from payload_min, that the device takes (and returns, as far as our
+// receive buffer allows) in all but one of a few rounds, a single failure is random loss, more mean the payload
+// is too large for the device or the path, this is the oob chunk size for image data and caps the
+// sectors per flash transfer packet, weak links get smaller chunks, good ones larger,
+// the result is kept for a day per host, port and protocol, in ~/.espif-payload
+
+unsigned int Util::payload_size() const
+{
+	enum { payload_min = 256, payload_max = 32768, rounds = 4, failures_max = 1, ttl_seconds = 24 * 60 * 60 };
+	std::string key, value;
+	unsigned int length, receive_max, round, failures;
+
+	if(negotiated_payload_size > 0)
+		return(negotiated_payload_size);
+
+	negotiated_payload_size = config.sector_size;
+
+	if(!config.payload_probe || config.raw || config.broadcast || config.multicast)
+		return(negotiated_payload_size);
+
+	HostCache cache("payload");
+
+	key = (boost::format("%s:%s/%s") % config.host % config.command_port % (config.use_tcp ? "tcp" : "udp")).str();
+
+	if(cache.lookup(key, value) && ((length = strtoul(value.c_str(), nullptr, 10)) >= payload_min))
+	{
+		negotiated_payload_size = length;
+
+		if(config.verbose)
+			std::cout << boost::format("payload size: %u (cached)") % negotiated_payload_size << std::endl;
+
+		return(negotiated_payload_size);
+	}
+
+	receive_max = std::max(config.transfer_sectors, 1U) * config.sector_size;
+	negotiated_payload_size = 0;
+
+	for(length = payload_min; length <= payload_max; length *= 2)
+	{
+		failures = 0;
+
+		for(round = 0; (round < rounds) && (failures <= failures_max); round++)
+			if(!probe_payload(length, false) || ((length <= receive_max) && !probe_payload(length, true)))
+				failures++;
+
+		if(config.verbose)
+			std::cout << boost::format("payload probe: %5u bytes %s, %u/%u rounds failed") % length %
+					((failures > failures_max) ? "rejected" : "ok") % failures % round << std::endl;
+
+		if(failures > failures_max)
+			break;
+
+		negotiated_payload_size = length;
+	}
+
+	// not even the smallest payload: firmware without flash-bench or no link at all, don't remember that
+
+	if(negotiated_payload_size == 0)
+	{
+		negotiated_payload_size = config.sector_size;
+
+		if(config.verbose)
+			std::cout << boost::format("payload size: probe failed, using %u") % negotiated_payload_size << std::endl;
+
+		return(negotiated_payload_size);
+	}
+
+	cache.store(key, std::to_string(negotiated_payload_size), ttl_seconds);
+	cache.save();
+
+	if(config.verbose)
+		std::cout << boost::format("payload size: %u") % negotiated_payload_size << std::endl;
+
+	return(negotiated_payload_size);
+}
+
+unsigned int Util::transfer_sectors() const
+{
+	enum { command_length_max = 64, tcp_length_max = 1024 * 1024 };
+	std::string reply;
+	std::string reply_oob;
+	boost::smatch capture;
+	boost::regex re("OK flash-read: read sector ([0-9]+), sectors ([0-9]+)");
+	unsigned int requested, offered, length_max;
+
+	if(negotiated_transfer_sectors > 0)
+		return(negotiated_transfer_sectors);
+
+	negotiated_transfer_sectors = 1;
+
+	if((config.transfer_sectors < 2) || config.raw)
+		return(negotiated_transfer_sectors);
+
+	// packet_header_t.length is 16 bits, so that's the upper limit for one packet,
+	// unless version 3 packets are used over tcp, udp is limited to 64k datagrams anyway
+
+	if((negotiated_packet_version == packet_header_version_3) && config.use_tcp)
+		length_max = tcp_length_max;
+	else
+		length_max = UINT16_MAX;
+
+	requested = std::min(config.transfer_sectors, (unsigned int)((length_max - sizeof(packet_header_t) - command_length_max) / config.sector_size));
+
+	// a flash packet carries whole sectors, a probed payload below a sector still means one sector per packet
+
+	if(config.payload_probe)
+		requested = std::min(requested, std::max(payload_size() / config.sector_size, 1U));
+
+	if(requested < 2)
+		return(negotiated_transfer_sectors);
+
+	// firmware that doesn't know about the sector count ignores it and returns one sector without "sectors"
+
+	try
+	{
+		process((boost::format("flash-read 0 %u\n") % requested).str(), "", reply, &reply_oob);
+	}
+	catch(const transient_exception &e)
+	{
+		if(config.verbose)
+			std::cout << boost::format("transfer sectors: probe failed: %s") % e.what() << std::endl;
+
+		return(negotiated_transfer_sectors);
+	}
+
+	if(boost::regex_match(reply, capture, re))
+	{
+		offered = std::stoul(capture[2]);
+
+		if((offered > 1) && (offered <= requested) && (reply_oob.length() >= (offered * config.sector_size)))
+			negotiated_transfer_sectors = offered;
+	}
+
+	if(config.verbose)
+		std::cout << boost::format("transfer sectors: requested %u, using %u") % requested % negotiated_transfer_sectors << std::endl;
+
+	return(negotiated_transfer_sectors);
+}
+
+int Util::read_sectors(unsigned int sector, unsigned int sectors, std::string &data) const
+{
+	std::vector<Transaction> transactions;
+	unsigned int current, remote_sector, remote_sectors, transfer;
+	int retries;
+
+	retries = 0;
+	transfer = transfer_sectors();
+	data.resize(sectors * config.sector_size);
+
+	if(((config.window < 2) || config.raw) && (transfer < 2))
+	{
+		for(current = 0; current < sectors; current++)
+			retries += read_sector(config.sector_size, sector + current, data.data() + (current * config.sector_size));
+
+		return(retries);
+	}
+
+	// replies are copied straight into data at the place their request asked for (the only copy of the payload),
+	// if the remote sector doesn't match, it's rejected below anyway,
+	// the command strings and the reply text and its parsing are still allocated per transaction
+
+	for(current = 0; current < sectors; current += transfer)
+	{
+		transactions.emplace_back();
+		transactions.back().reply_oob_buffer = data.data() + (current * config.sector_size);
+		transactions.back().reply_oob_buffer_size = std::min(transfer, sectors - current) * config.sector_size;
+
+		if(transfer < 2)
+			transactions.back().data = (boost::format("flash-read %u\n") % (sector + current)).str();
+		else
+			transactions.back().data = (boost::format("flash-read %u %u\n") % (sector + current) % std::min(transfer, sectors - current)).str();
+	}
+
+	try
+	{
+		retries = process_window(transactions, "OK flash-read: read sector ([0-9]+)(?:, sectors ([0-9]+))?");
+	}
+	catch(const transient_exception &e)
+	{
+		throw(transient_exception(boost::format("read sectors: %s") % e.what()));
+	}
+
+	for(const auto &it : transactions)
+	{
+		remote_sector = it.int_value[0];
+
+		if((remote_sector < sector) || (remote_sector >= (sector + sectors)) || (((remote_sector - sector) % transfer) != 0))
+			throw(transient_exception(boost::format("read sectors: sector out of range (%u, expected %u - %u)") % remote_sector % sector % (sector + sectors - 1)));
+
+		remote_sectors = std::min(transfer, sector + sectors - remote_sector);
+
+		if((transfer > 1) && (it.int_value[1] != (int)remote_sectors))
+			throw(transient_exception(boost::format("read sectors: incorrect sector count (%u vs. %u)") % remote_sectors % it.int_value[1]));
+
+		if(it.reply_oob_length < (remote_sectors * config.sector_size))
+			throw(transient_exception(boost::format("read sectors: incorrect length (%u vs. %u)") % (remote_sectors * config.sector_size) % it.reply_oob_length));
+
+		if(it.reply_oob_buffer != (data.data() + ((remote_sector - sector) * config.sector_size)))
+			throw(transient_exception(boost::format("read sectors: reply for sector %u out of order") % remote_sector));
+	}
+
+	return(retries);
+}
+
+// compressed is the oob data as made by compress_packets(), sent instead of data
+
 int Util::write_sector(unsigned int sector, const std::string &data,
-		unsigned int &written, unsigned int &erased, unsigned int &skipped, bool simulate) const
+		unsigned int &written, unsigned int &erased, unsigned int &skipped, bool simulate,
+		const std::string *compressed) const
 {
+	packet_header_3_t header = {};
+	Packet reply_packet;
 	std::string command;
 	std::string reply;
 	std::vector<int> int_value;
 	std::vector<std::string> string_value;
 	unsigned int attempt;
-	unsigned int process_tries;
+	int retries;
 
 	command = (boost::format("flash-write %u %u") % (simulate ? 0 : 1) % sector).str();
 
+	if(compressed)
+		header.flag.oob_compressed = 1;
+
+	retries = 0;
+
+	// a failed attempt counts as a retry too, on top of the retries within it
+
 	for(attempt = 4; attempt > 0; attempt--)
 	{
 		try
 		{
-			process_tries = process(command, data,
-					reply, nullptr, "OK flash-write: written mode ([01]), sector ([0-9]+), same ([01]), erased ([01])", &string_value, &int_value);
+			retries += process(command, compressed ? *compressed : data, reply_packet,
+					reply, nullptr, "OK flash-write: written mode ([01]), sector ([0-9]+), same ([01]), erased ([01])", &string_value, &int_value,
+					header.flags);
 
 			if(int_value[0] != (simulate ? 0 : 1))
 				throw(transient_exception(boost::format("invalid mode (%u vs. %u)") % (simulate ? 0 : 1) % int_value[0]));
@@ -239,6 +935,7 @@ int Util::write_sector(unsigned int sector, const std::string &data,
 		catch(const transient_exception &e)
 		{
 			std::cerr << std::endl << boost::format("flash sector write failed temporarily: %s, reply: %s ") % e.what() % reply << std::endl;
+			retries++;
 			continue;
 		}
 	}
@@ -246,7 +943,110 @@ int Util::write_sector(unsigned int sector, const std::string &data,
 	if(attempt == 0)
 		throw(hard_exception("write sector: no more attempts"));
 
-	return(process_tries);
+	return(retries);
+}
+
+int Util::write_sectors(unsigned int sector, const std::string &data,
+		unsigned int &written, unsigned int &erased, unsigned int &skipped, bool simulate,
+		const std::vector<std::string> *compressed) const
+{
+	packet_header_3_t header = {};
+	std::vector<Transaction> transactions;
+	unsigned int sectors, current, remote_sector, remote_sectors, transfer;
+	int retries;
+
+	sectors = data.length() / config.sector_size;
+	retries = 0;
+	transfer = transfer_sectors();
+	header.flag.oob_compressed = 1;
+
+	if(compressed && (compressed->size() != ((sectors + transfer - 1) / transfer)))
+		throw(hard_exception(boost::format("write sectors: %u compressed packets for %u sectors of %u") % compressed->size() % sectors % transfer));
+
+	if(((config.window < 2) || config.raw) && (transfer < 2))
+	{
+		for(current = 0; current < sectors; current++)
+			retries += write_sector(sector + current, data.substr(current * config.sector_size, config.sector_size),
+					written, erased, skipped, simulate,
+					(compressed && !(*compressed)[current].empty()) ? &(*compressed)[current] : nullptr);
+
+		return(retries);
+	}
+
+	for(current = 0; current < sectors; current += transfer)
+	{
+		remote_sectors = std::min(transfer, sectors - current);
+
+		transactions.emplace_back();
+
+		if(transfer < 2)
+			transactions.back().data = (boost::format("flash-write %u %u") % (simulate ? 0 : 1) % (sector + current)).str();
+		else
+			transactions.back().data = (boost::format("flash-write %u %u %u") % (simulate ? 0 : 1) % (sector + current) % remote_sectors).str();
+
+		if(compressed && !(*compressed)[transactions.size() - 1].empty())
+		{
+			transactions.back().oob_data = (*compressed)[transactions.size() - 1];
+			transactions.back().flags = header.flags;
+		}
+		else
+			transactions.back().oob_data = std::string_view(data).substr(current * config.sector_size, remote_sectors * config.sector_size);
+	}
+
+	try
+	{
+		retries = process_window(transactions, "OK flash-write: written mode ([01]), sector ([0-9]+), same ([01]), erased ([01])(?:, sectors ([0-9]+))?");
+	}
+	catch(const transient_exception &e)
+	{
+		throw(hard_exception(boost::format("write sectors: %s") % e.what()));
+	}
+
+	for(current = 0; current < transactions.size(); current++)
+	{
+		const std::vector<int> &int_value = transactions[current].int_value;
+
+		remote_sector = sector + (current * transfer);
+		remote_sectors = std::min(transfer, sector + sectors - remote_sector);
+
+		if(int_value[0] != (simulate ? 0 : 1))
+			throw(hard_exception(boost::format("write sectors: invalid mode (%u vs. %u)") % (simulate ? 0 : 1) % int_value[0]));
+
+		if(int_value[1] != (int)remote_sector)
+			throw(hard_exception(boost::format("write sectors: wrong sector (%u vs %u)") % remote_sector % int_value[1]));
+
+		if((transfer > 1) && (int_value[4] != (int)remote_sectors))
+			throw(hard_exception(boost::format("write sectors: wrong sector count (%u vs %u)") % remote_sectors % int_value[4]));
+
+		if(int_value[2] != 0)
+			skipped += remote_sectors;
+		else
+			written += remote_sectors;
+
+		if(int_value[3] != 0)
+			erased += remote_sectors;
+	}
+
+	return(retries);
+}
+
+// compressed oob data for write_sectors(), one entry per packet of transfer sectors, empty where compression
+// doesn't make it smaller, it doesn't touch the session, so it can run in a worker thread while the previous data is sent
+
+void Util::compress_packets(const std::string &data, unsigned int sector_size, unsigned int transfer, std::vector<std::string> &compressed)
+{
+	size_t offset, length;
+
+	compressed.clear();
+
+	for(offset = 0; offset < data.length(); offset += length)
+	{
+		length = std::min(data.length() - offset, (size_t)transfer * sector_size);
+		compressed.emplace_back();
+
+		if(!Lzss::compress(std::string_view(data).substr(offset, length), compressed.back()))
+			compressed.back().clear();
+	}
 }
 
 void Util::get_checksum(unsigned int sector, unsigned int sectors, std::string &checksum) const
@@ -311,6 +1111,75 @@ void Util::get_checksum(unsigned int sector, unsigned int sectors, std::string &
 	checksum = string_value[2];
 }
 
+// one checksum per sector, packed into the oob data of a few replies with flash-checksum-list,
+// firmware without it gets one flash-checksum per sector, in one or a few packets if it takes multiple commands
+
+void Util::get_checksums(unsigned int sector, unsigned int sectors, std::vector<std::string> &checksums) const
+{
+	boost::regex re("OK flash-checksum-list: checksummed ([0-9]+) sectors from sector ([0-9]+)");
+	boost::regex re_single("OK flash-checksum: checksummed ([0-9]+) sectors from sector ([0-9]+), checksum: ([0-9a-f]+)");
+	boost::smatch capture;
+	std::string reply, reply_oob;
+	std::vector<std::string> commands;
+	std::vector<CommandReply> replies;
+	unsigned int current, done, count, remote_sectors;
+
+	checksums.clear();
+
+	for(done = 0; (done < sectors) && !config.raw && (checksum_list_state != checksum_list_unsupported); done += remote_sectors)
+	{
+		count = std::min(sectors - done, payload_size() / flash_checksum_list_digest_size);
+
+		process((boost::format("flash-checksum-list %u %u\n") % (sector + done) % count).str(), "", reply, &reply_oob);
+
+		if(!boost::regex_match(reply, capture, re))
+		{
+			if(checksum_list_state == checksum_list_supported)
+				throw(hard_exception(boost::format("flash sector checksum list failed, reply: %s") % reply));
+
+			if(config.verbose)
+				std::cout << "flash-checksum-list: not supported by firmware" << std::endl;
+
+			checksum_list_state = checksum_list_unsupported;
+			break;
+		}
+
+		checksum_list_state = checksum_list_supported;
+		remote_sectors = std::stoul(capture[1]);
+
+		if((std::stoul(capture[2]) != (sector + done)) || (remote_sectors == 0) || (remote_sectors > count) ||
+				(reply_oob.length() != (remote_sectors * flash_checksum_list_digest_size)))
+			throw(hard_exception(boost::format("flash sector checksum list failed: invalid reply for sectors %u-%u, reply: %s") %
+					(sector + done) % (sector + done + count - 1) % reply));
+
+		for(current = 0; current < remote_sectors; current++)
+			checksums.push_back(sha1_hash_to_text(flash_checksum_list_digest_size,
+					(const unsigned char *)reply_oob.data() + (current * flash_checksum_list_digest_size)));
+	}
+
+	if(checksum_list_state == checksum_list_supported)
+		return;
+
+	for(current = 0; current < sectors; current++)
+		commands.push_back((boost::format("flash-checksum %u 1") % (sector + current)).str());
+
+	process_multi(commands, replies);
+
+	if(replies.size() != sectors)
+		throw(hard_exception(boost::format("flash sector checksums failed: %u replies for %u sectors") % replies.size() % sectors));
+
+	checksums.clear();
+
+	for(current = 0; current < sectors; current++)
+	{
+		if((replies[current].status != multi_command_status_ok) || !boost::regex_match(replies[current].data, capture, re_single) ||
+				(capture[1] != "1") || (std::stoul(capture[2]) != (sector + current)))
+			throw(hard_exception(boost::format("flash sector checksums failed: sector %u, reply: %s") % (sector + current) % replies[current].data));
+
+		checksums.push_back(capture[3]);
+	}
+}
+
 void Util::time_to_string(std::string &dst, const time_t &ticks)
 {
     struct tm tm;
@@ -321,3 +1190,14 @@ void Util::time_to_string(std::string &dst, const time_t &ticks)
 
 	dst = timestring;
 }
+
+// host byte order
+
+std::string Util::ip_text(uint32_t host_id)
+{
+	return((boost::format("%u.%u.%u.%u") %
+			((host_id & 0xff000000) >> 24) %
+			((host_id & 0x00ff0000) >> 16) %
+			((host_id & 0x0000ff00) >>  8) %
+			((host_id & 0x000000ff) >>  0)).str());
+}
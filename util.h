@@ -3,38 +3,106 @@
 
 #include "generic_socket.h"
 #include "util.h"
+#include "packet.h"
 #include "espifconfig.h"
 
 #include <string>
+#include <string_view>
 #include <vector>
+#include <stdint.h>
 
 class Util
 {
 	friend class Espif;
 	friend class GenericSocket;
+	friend class Fleet;
+	friend class EventLoop;
+	friend class IoUringBackend;
+	friend class FaultInjector;
 
 	protected:
 
 		Util() = delete;
 		Util(GenericSocket &channel, const EspifConfig &config) noexcept;
+		~Util() noexcept;
 
 		static std::string dumper(const char *id, const std::string text);
 		static std::string sha1_hash_to_text(unsigned int length, const unsigned char *hash);
 		static void time_to_string(std::string &dst, const time_t &ticks);
+		static std::string ip_text(uint32_t host_id);
+		static uint64_t time_usec() noexcept;
 
-		int process(const std::string &data, const std::string &oob_data,
+		// if reply_oob_buffer is set, the reply oob data is copied there (up to reply_oob_buffer_size)
+		// instead of to reply_oob_data, reply_oob_length is the length as received in both cases
+
+		struct Transaction
+		{
+			std::string data;
+			std::string_view oob_data;
+			std::string reply_data;
+			std::string reply_oob_data;
+			char *reply_oob_buffer = nullptr;
+			size_t reply_oob_buffer_size = 0;
+			size_t reply_oob_length = 0;
+			std::vector<int> int_value;
+			unsigned int flags = 0;
+		};
+
+		int process(const std::string &data, std::string_view oob_data,
 				std::string &reply_data, std::string *reply_oob_data,
 				const char *match = nullptr, std::vector<std::string> *string_value = nullptr, std::vector<int> *int_value = nullptr) const;
-		int read_sector(unsigned int sector_size, unsigned int sector, std::string &data) const;
+		int process(const std::string &data, std::string_view oob_data,
+				Packet &receive_packet, std::string &reply_data, std::string_view *reply_oob_data,
+				const char *match = nullptr, std::vector<std::string> *string_value = nullptr, std::vector<int> *int_value = nullptr,
+				unsigned int flags = 0) const;
+
+		struct CommandReply
+		{
+			~CommandReply() noexcept;
+
+			std::string data;
+			std::string oob_data;
+			unsigned int status;
+		};
+
+		int process_multi(const std::vector<std::string> &commands, std::vector<CommandReply> &replies) const;
+		int process_window(std::vector<Transaction> &transactions, const char *match) const;
+		int read_sector(unsigned int sector_size, unsigned int sector, char *data) const;
+		unsigned int transfer_sectors() const;
+		unsigned int payload_size() const;
+		int read_sectors(unsigned int sector, unsigned int sectors, std::string &data) const;
 		int write_sector(unsigned int sector, const std::string &data,
-				unsigned int &written, unsigned int &erased, unsigned int &skipped, bool simulate) const;
+				unsigned int &written, unsigned int &erased, unsigned int &skipped, bool simulate,
+				const std::string *compressed = nullptr) const;
+		int write_sectors(unsigned int sector, const std::string &data,
+				unsigned int &written, unsigned int &erased, unsigned int &skipped, bool simulate,
+				const std::vector<std::string> *compressed = nullptr) const;
+		bool oob_compression() const noexcept;
+		void reset_negotiation() const noexcept;
+		static void compress_packets(const std::string &data, unsigned int sector_size, unsigned int transfer,
+				std::vector<std::string> &compressed);
 		void get_checksum(unsigned int sector, unsigned int sectors,
 				std::string &checksum) const;
+		void get_checksums(unsigned int sector, unsigned int sectors,
+				std::vector<std::string> &checksums) const;
 
 
 	private:
 
 		GenericSocket &channel;
 		const EspifConfig config;
+		mutable uint32_t next_transaction_id;
+		mutable unsigned int negotiated_transfer_sectors;
+		mutable unsigned int negotiated_payload_size;
+		mutable bool negotiated_oob_compression;
+		mutable unsigned int negotiated_packet_version;
+		mutable enum { multi_command_unknown, multi_command_unsupported, multi_command_supported } multi_command_state;
+		mutable enum { checksum_list_unknown, checksum_list_unsupported, checksum_list_supported } checksum_list_state;
+		mutable PacketCodec codec;
+
+		uint32_t new_transaction_id() const noexcept;
+		void negotiate_packet_version(unsigned int version) const;
+		void negotiate_oob_compression(bool supported) const;
+		bool probe_payload(unsigned int length, bool receive) const;
 };
 #endif